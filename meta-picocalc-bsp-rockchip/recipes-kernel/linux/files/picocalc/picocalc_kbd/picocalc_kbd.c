@@ -17,16 +17,12 @@
 #include <linux/reboot.h>
 
 #include "picocalc_kbd_code.h"
+#include "../picocalc_mfd/picocalc_reg.h"
 
 //#include "config.h"
 #include "debug_levels.h"
 
-#define REG_ID_BAT (0x0b)
-#define REG_ID_BKL (0x05)
-#define REG_ID_FIF (0x09)
-#define REG_ID_BK2 (0x0A)
-
-#define PICOCALC_WRITE_MASK (1<<7)
+#define PICOCALC_WRITE_MASK MSB_MASK
 
 #define KBD_BUS_TYPE        BUS_I2C
 #define KBD_VENDOR_ID       0x0001
@@ -217,7 +213,7 @@ void input_fw_read_fifo(struct kbd_ctx* ctx)
 
         uint8_t data[2];
         // Read 2 fifo items
-        if ((rc = kbd_read_i2c_2u8(ctx->i2c_client, 0x09,
+        if ((rc = kbd_read_i2c_2u8(ctx->i2c_client, REG_ID_FIF,
             (uint8_t*)&data))) {
 
             dev_err(&ctx->i2c_client->dev,
@@ -876,7 +872,7 @@ static int picocalc_kbd_reboot_notifier(struct notifier_block *nb,
                  "%s sending poweroff event\n", __func__);
 
         // Register REG_ID_OFF
-        kbd_write_i2c_u8(g_ctx->i2c_client, 0x0e, KBD_POWEROFF_SEC);
+        kbd_write_i2c_u8(g_ctx->i2c_client, REG_ID_OFF, KBD_POWEROFF_SEC);
     }
     return NOTIFY_DONE;
 }
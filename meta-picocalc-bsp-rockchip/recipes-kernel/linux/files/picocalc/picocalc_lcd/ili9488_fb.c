@@ -8,13 +8,26 @@
 #include <linux/errno.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/sizes.h>
 #include <linux/compat.h>
 #include <linux/of.h>
 #include <linux/of_gpio.h>
 #include <linux/of_device.h>
+#include <linux/property.h>
+#include <linux/delay.h>
+#include <linux/pm_runtime.h>
 
 #include <linux/wait.h>
 #include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/poll.h>
+#include <uapi/linux/sched/types.h>
 
 #include <linux/spi/spi.h>
 #include <linux/spi/spidev.h>
@@ -26,13 +39,42 @@
 #include <linux/fbcon.h>
 #include <video/mipi_display.h>
 
+#include "ili9488_fb.h"
+
 #define DRV_NAME "ili9488_drv"
 
+/* initial wire format, switched at runtime through nonstd or sysfs */
 static int p_3bit_mode = 0;
-module_param(p_3bit_mode, int, 0660);
+module_param(p_3bit_mode, int, 0440);
 
 static int p_dither = 0;
-module_param(p_dither, int, 0660);
+module_param(p_dither, int, 0440);
+
+/* SCHED_FIFO priority of the flush thread, 0 (default) keeps it SCHED_NORMAL */
+static int p_flush_prio = 0;
+module_param(p_flush_prio, int, 0440);
+
+/* CPU the flush thread is bound to, -1 lets the scheduler pick */
+static int p_flush_cpu = -1;
+module_param(p_flush_cpu, int, 0440);
+
+/*
+ * vmem format: 8 palettized, 16 RGB565 or 32 XRGB8888, converted on flush.
+ * 0 takes the bpp property from DT.
+ */
+static int p_bpp = 0;
+module_param(p_bpp, int, 0440);
+
+/* render the console through fb_tileops when the kernel supports it */
+static int p_tileblit = 1;
+module_param(p_tileblit, int, 0440);
+
+/* panel state after p_pm_delay_ms without damage: 0 stay on, 1 idle (8 colours), 2 sleep */
+static int p_pm_mode;
+module_param(p_pm_mode, int, 0440);
+
+static int p_pm_delay_ms = 10000;
+module_param(p_pm_delay_ms, int, 0440);
 
 struct ili9488_par;
 
@@ -45,6 +87,19 @@ struct ili9488_operations {
     int (*set_addr_win)(struct ili9488_par *par, int xs, int ys, int xe, int ye);
 };
 
+#define ILI9488_GAMMA_NUM           2   /* positive and negative curve */
+#define ILI9488_GAMMA_LEN           15
+
+/* DT init sequence: command bytes and delays are tagged, parameters are not */
+#define ILI9488_INIT_CMD            0x01000000
+#define ILI9488_INIT_DELAY          0x02000000
+#define ILI9488_INIT_MAX_ARGS       64
+
+/*
+ * Panel configuration, read from DT at probe. Resolution is in panel
+ * orientation, the offsets locate the visible area in the controller's
+ * 320x480 frame memory as addressed after rotation.
+ */
 struct ili9488_display {
     u32                     xres;
     u32                     yres;
@@ -52,13 +107,119 @@ struct ili9488_display {
     u32                     fps;
     u32                     rotate;
     u32                     xs_off;
-    u32                     xe_off;
     u32                     ys_off;
-    u32                     ye_off;
+    bool                    three_bit;
+    bool                    dither;
+
+    /* SPI clock for commands and for pixel data, 0 uses spi-max-frequency */
+    u32                     cmd_speed_hz;
+    u32                     write_speed_hz;
+
+    /* replaces the built-in power and timing setup when set */
+    u32                     *init;
+    int                     init_len;
+
+    u8                      gamma[ILI9488_GAMMA_NUM][ILI9488_GAMMA_LEN];
+};
+
+enum ili9488_pm_state {
+    ILI9488_PM_ACTIVE,
+    ILI9488_PM_IDLE,
+    ILI9488_PM_SLEEP,
+    ILI9488_PM_NR,
+};
+
+enum ili9488_filter {
+    ILI9488_FILTER_NONE,
+    ILI9488_FILTER_GRAYSCALE,
+    ILI9488_FILTER_NIGHT,
+    ILI9488_FILTER_INVERT,
+    ILI9488_FILTER_NR,
+};
+
+/* sleep out needs 5ms before the next command and 120ms before sleep in */
+#define ILI9488_SLEEP_OUT_US        5000
+#define ILI9488_SLEEP_OUT_GUARD_MS  120
+
+/*
+ * Private var.nonstd layout, lets FBIOPUT_VSCREENINFO switch the wire
+ * format at runtime: [7:0] target fps (0 keeps the current rate),
+ * bit 8 selects 3 bit transfers and bit 9 dithers them.
+ */
+#define ILI9488_NONSTD_FPS      GENMASK(7, 0)
+#define ILI9488_NONSTD_3BIT     BIT(8)
+#define ILI9488_NONSTD_DITHER   BIT(9)
+#define ILI9488_FPS_MAX         120
+
+struct ili9488_mode {
+    bool                    three_bit;
+    bool                    dither;
+    u32                     fps;
+};
+
+/* damage records queued per reader of the damage device */
+#define ILI9488_DAMAGE_DEPTH    64
+
+struct ili9488_rect {
+    u32 xs;
+    u32 ys;
+    u32 xe;
+    u32 ye;
+};
+
+/* largest cursor cell pushed through the dedicated cursor message */
+#define ILI9488_CURSOR_MAX      32
+#define ILI9488_CURSOR_BUF      (ILI9488_CURSOR_MAX * ILI9488_CURSOR_MAX * 2)
+#define ILI9488_CURSOR_RECTS    4
+
+/*
+ * rows converted per SPI write while flushing, a newer frame is checked for
+ * before each batch so a superseded flush stops converting early
+ */
+#define ILI9488_FLUSH_BATCH     SZ_32K
+
+/* narrowest and shortest font accepted while tile blitting */
+#define ILI9488_TILE_MIN    4
+#define ILI9488_TILE_SLOTS  4
+
+/* glyphs pre-rendered in RGB565 for one fg/bg colour pair */
+struct ili9488_glyph_slot {
+    u16                     fg;
+    u16                     bg;
+    unsigned long           last_use;
+    unsigned long           *valid;
+    u16                     *pixels;
+};
+
+struct ili9488_tile_cell {
+    u16                     index;
+    u8                      fg;
+    u8                      bg;
+};
 
-    char *gamma;
-    int gamma_num;
-    int gamma_len;
+struct ili9488_tile {
+    /* font and glyph cache, serialized by the console lock */
+    u32                     length;
+    u32                     pitch;
+    u8                      *font;
+    unsigned long           tick;
+    struct ili9488_glyph_slot slot[ILI9488_TILE_SLOTS];
+    struct ili9488_tile_cell *cells;
+
+    /* cell geometry and dirty cell grid, protected by dirty_lock */
+    u32                     width;
+    u32                     height;
+    u32                     cols;
+    u32                     rows;
+    u32                     max_cells;
+    unsigned long           *dirty;
+
+    /* dirty cell extents per row, only used by the flush thread */
+    u32                     flush_width;
+    u32                     flush_height;
+    u32                     flush_rows;
+    u16                     *row_first;
+    u16                     *row_last;
 };
 
 struct ili9488_par {
@@ -81,6 +242,10 @@ struct ili9488_par {
 
     spinlock_t              dirty_lock;
     struct completion       complete;
+    /* serializes command/pixel sequences on the SPI bus */
+    struct mutex            io_lock;
+    /* no pixel traffic while set, damage keeps accumulating; under dirty_lock */
+    bool                    blanked;
 
     /* device specific */
     u32                     refr_mode;
@@ -88,33 +253,184 @@ struct ili9488_par {
     u32                     busy;
 
     const struct ili9488_operations        *tftops;
-    const struct ili9488_display           *display;
+    struct ili9488_display                 display;
+
+    /* wire format, written under io_lock and the fb_info lock */
+    struct ili9488_mode     mode;
 
     struct fb_info          *fbinfo;
     struct fb_ops           *fbops;
 
     u32             pseudo_palette[16];
 
+    /* 8bpp PSEUDOCOLOR palette, each entry expanded once by fb_setcolreg */
+    u16             palette_raw[256];
+    u16             palette[256];
+    u8              palette_3bit[256];
+
+    /* colour filter table indexed by RGB565, lut is NULL when off; under io_lock */
+    enum ili9488_filter     filter;
+    u16                     *lut_buf;
+    const u16               *lut;
+
     u32             dirty_lines_start;
     u32             dirty_lines_end;
+
+    struct ili9488_tile     tile;
+
+    /* band of rows driven in Partial Mode, changed under io_lock */
+    struct {
+        bool                    on;
+        u32                     ys;
+        u32                     ye;
+    } partial;
+
+    /* cursor cells pushed outside the deferred flush, pending is under dirty_lock */
+    struct {
+        struct kthread_work     work;
+        struct ili9488_rect     pending[ILI9488_CURSOR_RECTS];
+        u32                     npending;
+        u8                      *buf;
+        struct spi_transfer     xfer;
+        struct spi_message      msg;
+    } cursor;
+
+    /* flush thread, protected by dirty_lock */
+    struct kthread_worker           *flush_worker;
+    struct kthread_delayed_work     flush_work;
+    bool                            flush_pending;
+    ktime_t                         flush_due;
+
+    /*
+     * Application frames (an mmap deferred-io batch or a write()) and what
+     * became of them, protected by dirty_lock. A frame still pending when
+     * the next one arrives is merged with it, or dropped when the next one
+     * covers it completely and it never reaches the panel. While flushing,
+     * a newly pending frame that covers the rows not sent yet cuts the
+     * flush short, counted in superseded.
+     */
+    struct {
+        bool                        pending;
+        bool                        flushing;
+        u32                         ys;
+        u32                         ye;
+        u64                         submitted;
+        u64                         flushed;
+        u64                         merged;
+        u64                         dropped;
+        u64                         superseded;
+    } frames;
+
+    /* panel power state, changed by the runtime PM callbacks under io_lock */
+    struct {
+        enum ili9488_pm_state   state;
+        ktime_t                 since;
+        u64                     time_ns[ILI9488_PM_NR];
+        u64                     entries[ILI9488_PM_NR];
+        /* a resume only starts the exit, the first command waits for it */
+        bool                    waking;
+        enum ili9488_pm_state   wake_from;
+        ktime_t                 wake_start;
+        ktime_t                 wake_ready;
+        /* mode 0 keeps a usage reference while unblanked */
+        bool                    hold;
+        u64                     wakes;
+        u64                     wake_wait_total_ns;
+        u64                     wake_wait_max_ns;
+        u64                     wake_hidden_total_ns;
+    } pm;
+
+    struct {
+        u64 flushes;
+        u64 sched_delay_total_ns;
+        u64 sched_delay_max_ns;
+        u64 flush_total_ns;
+        u64 flush_max_ns;
+        u64 flush_bytes;
+        u64 cursor_pushes;
+        u64 cursor_bytes;
+        u64 video_frames;
+        u64 video_bytes;
+        u64 video_dropped;
+    } stats;
+
+    /* damage device, the readers hang off hub */
+    struct {
+        struct miscdevice       misc;
+        struct ili9488_damage_hub *hub;
+        /* flush sequence number, only touched by the flush thread */
+        u32                     seq;
+    } damage;
+
+    /* ILI9488_IOC_YUV_FRAME: one frame goes out while the next one converts */
+    struct {
+        struct mutex            lock;
+        struct kthread_work     work;
+        u8                      *buf[2];
+        u32                     next;
+        u8                      *in;
+        u16                     *row;
+        /* handed to the flush thread, complete is signalled once it is sent */
+        u8                      *pending;
+        struct ili9488_rect     rect;
+        size_t                  row_bytes;
+        bool                    three_bit;
+    } video;
+
+    struct dentry           *debugfs;
+};
+
+/*
+ * Reader list of the damage device. Open files keep a reference, so it
+ * outlives par when a daemon still holds the fd at remove, those readers
+ * see end of file once dead is set. Everything is under lock.
+ */
+struct ili9488_damage_hub {
+    struct kref                     ref;
+    spinlock_t                      lock;
+    struct list_head                readers;
+    wait_queue_head_t               wait;
+    bool                            dead;
+    /* of the last record published, for overflow records */
+    u32                             seq;
+    u32                             xres;
+    u32                             yres;
+};
+
+struct ili9488_damage_reader {
+    struct ili9488_damage_hub       *hub;
+    struct list_head                node;
+    bool                            overflow;
+    DECLARE_KFIFO(fifo, struct ili9488_damage, ILI9488_DAMAGE_DEPTH);
 };
 
 #define gpio_put(d, v) gpiod_set_raw_value(d, v)
-int fbtft_write_spi_wr(struct ili9488_par *par, void *buf, size_t len)
+static int ili9488_spi_write(struct ili9488_par *par, void *buf, size_t len,
+                             u32 speed_hz)
 {
-    int rc;
-    rc = spi_write(par->spi, buf, len);
+    struct spi_transfer t = {
+        .tx_buf = buf,
+        .len = len,
+        .speed_hz = speed_hz,
+    };
 
-    return rc;
+    return spi_sync_transfer(par->spi, &t, 1);
+}
+
+/* pixel data, at the write clock */
+int fbtft_write_spi_wr(struct ili9488_par *par, void *buf, size_t len)
+{
+    return ili9488_spi_write(par, buf, len, par->display.write_speed_hz);
 }
 
 /*
 int fbtft_write_gpio16_wr(struct ili9488_par *par, void *buf, size_t len)
 */
+/* commands and their parameters, at the command clock */
 static inline void fbtft_write_buf_dc(struct ili9488_par *par, void *buf, size_t len, int dc)
 {
     gpio_put(par->gpio.dc, dc);
-    fbtft_write_spi_wr(par, buf, len);
+    ili9488_spi_write(par, buf, len, par->display.cmd_speed_hz);
 }
 
 #define NUMARGS(...)  (sizeof((int[]){__VA_ARGS__}) / sizeof(int))
@@ -147,6 +463,21 @@ exit_no_param:
 #define write_reg(par, ...) \
     ili9488_write_reg(par, NUMARGS(__VA_ARGS__), __VA_ARGS__)
 
+/* same as write_reg for a parameter list built at runtime, len <= 128 */
+static void ili9488_write_reg_buf(struct ili9488_par *par, u8 cmd,
+                                  const u8 *data, size_t len)
+{
+    u8 *buf = (u8 *)par->buf;
+
+    *buf = cmd;
+    fbtft_write_buf_dc(par, buf, sizeof(u8), 0);
+    if (!len)
+        return;
+
+    memcpy(buf, data, len);
+    fbtft_write_buf_dc(par, buf, len, 1);
+}
+
 static int ili9488_reset(struct ili9488_par *par)
 {
     gpio_put(par->gpio.rst, 1);
@@ -158,23 +489,77 @@ static int ili9488_reset(struct ili9488_par *par)
     return 0;
 }
 
+/* init property from DT, validated when it was read */
+static void ili9488_run_init(struct ili9488_par *par)
+{
+    const u32 *seq = par->display.init;
+    const int n = par->display.init_len;
+    u8 args[ILI9488_INIT_MAX_ARGS];
+    int i = 0, j;
+    u8 cmd;
+
+    while (i < n) {
+        if (seq[i] & ILI9488_INIT_DELAY) {
+            msleep(seq[i++] & 0xFFFF);
+            continue;
+        }
+
+        cmd = seq[i++] & 0xFF;
+        for (j = 0; i < n && !(seq[i] & (ILI9488_INIT_CMD | ILI9488_INIT_DELAY)); j++)
+            args[j] = seq[i++];
+        ili9488_write_reg_buf(par, cmd, args, j);
+    }
+}
+
+static void ili9488_set_gamma(struct ili9488_par *par)
+{
+    static const u8 cmd[ILI9488_GAMMA_NUM] = {
+        0xE0,   // Positive Gamma Control
+        0xE1,   // Negative Gamma Control
+    };
+    int i;
+
+    for (i = 0; i < ILI9488_GAMMA_NUM; i++)
+        ili9488_write_reg_buf(par, cmd[i], par->display.gamma[i],
+                              ILI9488_GAMMA_LEN);
+}
+
+#define MADCTL_BGR BIT(3) /* bitmask for RGB/BGR order */
+#define MADCTL_MV BIT(5) /* bitmask for page/column order */
+#define MADCTL_MX BIT(6) /* bitmask for column address order */
+#define MADCTL_MY BIT(7) /* bitmask for page address order */
+static void ili9488_set_var(struct ili9488_par *par)
+{
+    u8 madctl_par = MADCTL_BGR;
+
+    /* the panel is mounted column mirrored, rotate 0 is MX */
+    switch (par->display.rotate) {
+    case 90:
+        madctl_par |= MADCTL_MV;
+        break;
+    case 180:
+        madctl_par |= MADCTL_MY;
+        break;
+    case 270:
+        madctl_par |= (MADCTL_MV | MADCTL_MX | MADCTL_MY);
+        break;
+    default:
+        madctl_par |= MADCTL_MX;
+        break;
+    }
+
+    write_reg(par, MIPI_DCS_SET_ADDRESS_MODE, madctl_par);
+}
+
 static int ili9488_init_display(struct ili9488_par *priv)
 {
     ili9488_reset(priv);
 
     gpio_put(priv->gpio.cs, 0);
-    // Positive Gamma Control
-    write_reg(priv, 0xE0, 0x00, 0x03, 0x09, 0x08, 0x16, 0x0A, 0x3F, 0x78, 0x4C, 0x09, 0x0A, 0x08, 0x16, 0x1A, 0x0F);
-
-    // Negative Gamma Control
-    write_reg(priv, 0xE1, 0x00, 0x16, 0x19, 0x03, 0x0F, 0x05, 0x32, 0x45, 0x46, 0x04, 0x0E, 0x0D, 0x35, 0x37, 0x0F);
-
-    write_reg(priv, 0xC0, 0x17, 0x15);          // Power Control 1
-    write_reg(priv, 0xC1, 0x41);                // Power Control 2
-    write_reg(priv, 0xC5, 0x00, 0x12, 0x80);    // VCOM Control
-    write_reg(priv, 0x36, 0x48);                // Memory Access Control
+    ili9488_set_gamma(priv);
+    ili9488_set_var(priv);
 
-    if (p_3bit_mode)
+    if (priv->mode.three_bit)
     {
         write_reg(priv, 0x3A, 0x22);                // Pixel Interface Format  3 bit colour for SPI
     }
@@ -183,6 +568,14 @@ static int ili9488_init_display(struct ili9488_par *priv)
         write_reg(priv, 0x3A, 0x55);                // Pixel Interface Format  16 bit colour for SPI
     }
 
+    if (priv->display.init) {
+        ili9488_run_init(priv);
+        goto sleep_out;
+    }
+
+    write_reg(priv, 0xC0, 0x17, 0x15);          // Power Control 1
+    write_reg(priv, 0xC1, 0x41);                // Power Control 2
+    write_reg(priv, 0xC5, 0x00, 0x12, 0x80);    // VCOM Control
     write_reg(priv, 0xB0, 0x00);                // Interface Mode Control
 
     // Frame Rate Control
@@ -196,6 +589,8 @@ static int ili9488_init_display(struct ili9488_par *priv)
     write_reg(priv, 0xB7, 0xC6);                // Entry Mode Set
     write_reg(priv, 0xE9, 0x00);
     write_reg(priv, 0xF7, 0xA9, 0x51, 0x2C, 0x82);  // Adjust Control 3
+
+sleep_out:
     write_reg(priv, 0x11);                      // Exit Sleep
     mdelay(120);
     write_reg(priv, 0x29);                      // Display on
@@ -225,6 +620,11 @@ static int ili9488_set_addr_win(struct ili9488_par *par, int xs, int ys, int xe,
 {
     dev_dbg(par->dev, "xs = %d, xe = %d, ys = %d, ye = %d\n", xs, xe, ys, ye);
 
+    xs += par->display.xs_off;
+    xe += par->display.xs_off;
+    ys += par->display.ys_off;
+    ye += par->display.ys_off;
+
     write_reg(par, 0x2A,
               ((xs >> BITS_PER_BYTE)), (xs & 0xFF),
               ((xe >> BITS_PER_BYTE)), (xe & 0xFF));
@@ -238,33 +638,36 @@ static int ili9488_set_addr_win(struct ili9488_par *par, int xs, int ys, int xe,
     return 0;
 }
 
-// static int ili9488_idle(struct ili9488_par *par, bool on)
-// {
-//     if (on)
-//         write_reg(par, MIPI_DCS_EXIT_IDLE_MODE);
-//     else
-//         write_reg(par, MIPI_DCS_EXIT_IDLE_MODE);
+static int ili9488_idle(struct ili9488_par *par, bool on)
+{
+    gpio_put(par->gpio.cs, 0);
+    if (on)
+        write_reg(par, MIPI_DCS_ENTER_IDLE_MODE);
+    else
+        write_reg(par, MIPI_DCS_EXIT_IDLE_MODE);
+    gpio_put(par->gpio.cs, 1);
 
-//     return 0;
-// }
+    return 0;
+}
 
-// static int ili9488_sleep(struct ili9488_par *par, bool on)
-// {
-//     if (on) {
-//         write_reg(par, MIPI_DCS_SET_DISPLAY_OFF);
-//         write_reg(par, MIPI_DCS_ENTER_SLEEP_MODE);
-//     } else {
-//         write_reg(par, MIPI_DCS_EXIT_SLEEP_MODE);
-//         write_reg(par, MIPI_DCS_SET_DISPLAY_ON);
-//     }
+static int ili9488_sleep(struct ili9488_par *par, bool on)
+{
+    gpio_put(par->gpio.cs, 0);
+    if (on) {
+        write_reg(par, MIPI_DCS_SET_DISPLAY_OFF);
+        write_reg(par, MIPI_DCS_ENTER_SLEEP_MODE);
+    } else {
+        write_reg(par, MIPI_DCS_EXIT_SLEEP_MODE);
+    }
+    gpio_put(par->gpio.cs, 1);
 
-//     return 0;
-// }
+    return 0;
+}
 
 static int ili9488_clear(struct ili9488_par *priv)
 {
-    u32 width = priv->display->xres;
-    u32 height = priv->display->yres;
+    u32 width = priv->display.xres;
+    u32 height = priv->display.yres;
     u32 clear = 0x0;
     int x, y;
 
@@ -272,7 +675,7 @@ static int ili9488_clear(struct ili9488_par *priv)
     ili9488_set_addr_win(priv, 0, 0, width, height);
 
     gpio_put(priv->gpio.dc, 1);
-    if (p_3bit_mode)
+    if (priv->mode.three_bit)
     {
         for (x = 0; x < width / 2; x++)
             for (y = 0; y < height; y++)
@@ -290,11 +693,11 @@ static int ili9488_clear(struct ili9488_par *priv)
 }
 
 static const struct ili9488_operations default_ili9488_ops = {
-    // .idle  = ili9488_idle,
+    .idle  = ili9488_idle,
     .clear = ili9488_clear,
-    // .blank = ili9488_blank,
+    .blank = ili9488_blank,
     .reset = ili9488_reset,
-    // .sleep = ili9488_sleep,
+    .sleep = ili9488_sleep,
     .set_addr_win = ili9488_set_addr_win,
 };
 
@@ -377,45 +780,123 @@ static int ili9488_of_config(struct ili9488_par *par)
         return rc;
     }
     return 0;
+}
+
+static const u8 ili9488_default_gamma[ILI9488_GAMMA_NUM][ILI9488_GAMMA_LEN] = {
+    { 0x00, 0x03, 0x09, 0x08, 0x16, 0x0A, 0x3F, 0x78, 0x4C, 0x09, 0x0A, 0x08, 0x16, 0x1A, 0x0F },
+    { 0x00, 0x16, 0x19, 0x03, 0x0F, 0x05, 0x32, 0x45, 0x46, 0x04, 0x0E, 0x0D, 0x35, 0x37, 0x0F },
+};
+
+/* checks the init property so ili9488_run_init can trust it */
+static int ili9488_of_init_sequence(struct device *dev,
+                                    struct ili9488_display *disp)
+{
+    int n, i, args = -1;
+    u32 *seq;
+
+    n = device_property_count_u32(dev, "init");
+    if (n <= 0)
+        return 0;
+
+    seq = devm_kcalloc(dev, n, sizeof(*seq), GFP_KERNEL);
+    if (!seq)
+        return -ENOMEM;
+    device_property_read_u32_array(dev, "init", seq, n);
+
+    for (i = 0; i < n; i++) {
+        if (seq[i] & ILI9488_INIT_DELAY) {
+            args = -1;
+        } else if (seq[i] & ILI9488_INIT_CMD) {
+            args = 0;
+        } else if (args < 0 || seq[i] > 0xFF || ++args > ILI9488_INIT_MAX_ARGS) {
+            dev_err(dev, "init: bad value 0x%x at %d\n", seq[i], i);
+            return -EINVAL;
+        }
+    }
+
+    disp->init = seq;
+    disp->init_len = n;
+    return 0;
+}
+
+/*
+ * Everything but the GPIOs can be left out, giving the PicoCalc panel. A DT
+ * overlay can switch between a fast 3 bit and a 16 bit quality profile
+ * without rebuilding the module.
+ */
+static int ili9488_of_display(struct device *dev, struct ili9488_display *disp)
+{
+    u32 mem_w = 320, mem_h = 480, w, h;
+    int rc;
+
+    memset(disp, 0, sizeof(*disp));
+    disp->xres = 320;
+    disp->yres = 320;
+    disp->bpp = 16;
+    memcpy(disp->gamma, ili9488_default_gamma, sizeof(disp->gamma));
+
+    device_property_read_u32(dev, "width", &disp->xres);
+    device_property_read_u32(dev, "height", &disp->yres);
+    device_property_read_u32(dev, "bpp", &disp->bpp);
+    device_property_read_u32(dev, "rotate", &disp->rotate);
+    device_property_read_u32(dev, "x-offset", &disp->xs_off);
+    device_property_read_u32(dev, "y-offset", &disp->ys_off);
+    device_property_read_u32(dev, "cmd-speed-hz", &disp->cmd_speed_hz);
+    device_property_read_u32(dev, "write-speed-hz", &disp->write_speed_hz);
+    disp->three_bit = p_3bit_mode || device_property_read_bool(dev, "three-bit");
+    disp->dither = p_dither || device_property_read_bool(dev, "dither");
+
+    /* 3 bit packs two pixels per byte and can go twice as fast */
+    disp->fps = disp->three_bit ? 60 : 30;
+    device_property_read_u32(dev, "fps", &disp->fps);
+
+    if (disp->rotate % 90 || disp->rotate > 270) {
+        dev_warn(dev, "unsupported rotate %u, using 0\n", disp->rotate);
+        disp->rotate = 0;
+    }
+
+    if (disp->rotate == 90 || disp->rotate == 270) {
+        w = disp->yres;
+        h = disp->xres;
+        swap(mem_w, mem_h);
+    } else {
+        w = disp->xres;
+        h = disp->yres;
+    }
+
+    if (!w || !h || w > mem_w || h > mem_h ||
+        disp->xs_off > mem_w - w || disp->ys_off > mem_h - h) {
+        dev_err(dev, "%ux%u at %u,%u does not fit the panel\n",
+                disp->xres, disp->yres, disp->xs_off, disp->ys_off);
+        return -EINVAL;
+    }
+
+    /* 3 bit pixels go out in pairs starting on even columns */
+    if (disp->xs_off & 1) {
+        dev_err(dev, "x-offset must be even\n");
+        return -EINVAL;
+    }
+
+    if (disp->bpp != 8 && disp->bpp != 16 && disp->bpp != 32) {
+        dev_warn(dev, "unsupported bpp %u, using 16\n", disp->bpp);
+        disp->bpp = 16;
+    }
+
+    disp->fps = clamp_t(u32, disp->fps, 1, ILI9488_FPS_MAX);
+
+    rc = device_property_read_u8_array(dev, "gamma", &disp->gamma[0][0],
+                                       sizeof(disp->gamma));
+    if (rc && rc != -EINVAL) {
+        dev_err(dev, "gamma needs %zu bytes\n", sizeof(disp->gamma));
+        return rc;
+    }
 
-    /* request xres and yres from dt */
-}
-
-// #define MADCTL_BGR BIT(3) /* bitmask for RGB/BGR order */
-// #define MADCTL_MV BIT(5) /* bitmask for page/column order */
-// #define MADCTL_MX BIT(6) /* bitmask for column address order */
-// #define MADCTL_MY BIT(7) /* bitmask for page address order */
-// static int ili9488_set_var(struct ili9488_par *par)
-// {
-//     u8 madctl_par = 0;
-
-//     switch (par->fbinfo->var.rotate) {
-//     case 0:
-//         break;
-//     case 90:
-//         madctl_par |= (MADCTL_MV | MADCTL_MY);
-//         break;
-//     case 180:
-//         madctl_par |= (MADCTL_MX | MADCTL_MY);
-//         break;
-//     case 270:
-//         madctl_par |= (MADCTL_MV | MADCTL_MX);
-//         break;
-//     default:
-//         return -EINVAL;
-
-//     }
-
-//     write_reg(par, MIPI_DCS_SET_ADDRESS_MODE, madctl_par);
-//     return 0;
-// }
+    return ili9488_of_init_sequence(dev, disp);
+}
 
 static int ili9488_hw_init(struct ili9488_par *par)
 {
     ili9488_init_display(par);
-
-    // ili9488_set_var(par);
-    // ili9488_set_gamma(par, default_curves);
     
     /*
     ili9488_clear(par);
@@ -451,13 +932,12 @@ static inline u16 rgb565_to_grayscale(u16 rgb565)
     r = b = gray * 31 / 255;  // 0 ~ 31
     g = gray * 63 / 255;
 
-    return cpu_to_be16(to_rgb565(r, g, b));
+    return to_rgb565(r, g, b);
 }
 
-static inline u16 rgb565_to_grayscale_byweight(u16 rgb565)
+static inline u8 rgb565_luma(u16 rgb565)
 {
     int r,g,b;
-    u16 gray;
 
     /* get each channel and expand them to 8 bit */
     r = RED(rgb565);
@@ -465,13 +945,25 @@ static inline u16 rgb565_to_grayscale_byweight(u16 rgb565)
     b = BLUE(rgb565);
 
     /* convert rgb888 to grayscale */
-    gray = ((r * 77 + g * 151 + b * 28) >> 8); // 0 ~ 255
+    return (r * 77 + g * 151 + b * 28) >> 8; // 0 ~ 255
+}
+
+static inline u16 rgb565_to_grayscale_byweight(u16 rgb565)
+{
+    int r,g,b;
+    u16 gray = rgb565_luma(rgb565);
 
     /* map to rgb565 format */
     r = b = gray * 31 / 255;  // 0 ~ 31
     g = gray * 63 / 255;
 
-    return cpu_to_be16(to_rgb565(r, g, b));
+    return to_rgb565(r, g, b);
+}
+
+/* red only, keeps night vision */
+static inline u16 rgb565_to_night(u16 rgb565)
+{
+    return to_rgb565(rgb565_luma(rgb565) * 31 / 255, 0, 0);
 }
 
 const uint8_t dither_4x4[4][4] =
@@ -516,285 +1008,1127 @@ const uint8_t dither_16x16[16][16] =
 
 const size_t matrix_size = 8;
 
-static int write_vmem_3bit_dither(struct ili9488_par *par, size_t offset, size_t len)
+#define PIX3_RED    (1 << 2)
+#define PIX3_GREEN  (1 << 1)
+#define PIX3_BLUE   (1 << 3)
+
+/*
+ * Map one RGB565 pixel to the 3 bit colour bits, a channel is lit when it
+ * is above the given threshold (red and blue are 5 bit, green is 6 bit).
+ */
+static inline u8 rgb565_to_3bit(u16 c, u8 thr_rb, u8 thr_g)
 {
-    u16 *vmem16;
-    u8 *txbuf = par->txbuf.buf;
-    size_t remain;
-    size_t to_copy;
-    size_t tx_array_size;
-    int i;
-    int k;
-    size_t cur_offset = offset;
-    const size_t width = par->display->xres;
-    const uint8_t color_red = 1 << 2;
-    const uint8_t color_green = 1 << 1;
-    const uint8_t color_blue = 1 << 3;
+    u8 v = 0;
 
-    dev_dbg(par->dev, "%s, offset = %d, len = %d\n", __func__, offset, len);
+    if (((c & 0xF800) >> 11) > thr_rb)
+        v |= PIX3_RED;
+    if (((c & 0x07E0) >> 5) > thr_g)
+        v |= PIX3_GREEN;
+    if ((c & 0x001F) > thr_rb)
+        v |= PIX3_BLUE;
 
-    remain = len / 2;
-    vmem16 = (u16 *)(par->fbinfo->screen_buffer + offset);
+    return v;
+}
 
-    gpio_put(par->gpio.dc, 1);
+/* same for an XRGB8888 pixel, all channels share one 8 bit threshold */
+static inline u8 xrgb8888_to_3bit(u32 c, u8 thr)
+{
+    u8 v = 0;
 
-    /* non-buffered spi write */
-    if (!par->txbuf.buf)
-        return fbtft_write_spi_wr(par, vmem16, len);
+    if (((c >> 16) & 0xFF) > thr)
+        v |= PIX3_RED;
+    if (((c >> 8) & 0xFF) > thr)
+        v |= PIX3_GREEN;
+    if ((c & 0xFF) > thr)
+        v |= PIX3_BLUE;
 
-    tx_array_size = par->txbuf.len / 3;
+    return v;
+}
 
-    while (remain) {
-        to_copy = min(tx_array_size, remain);
-        dev_dbg(par->fbinfo->device, "to_copy=%zu, remain=%zu\n",
-                to_copy, remain - to_copy);
+/*
+ * Row converters: turn n vmem pixels starting at column x of row y into
+ * the wire format at dst and return the number of bytes produced.
+ * The 3 bit formats pack two pixels per byte, so x and n are always even.
+ */
+typedef size_t (*ili9488_conv_fn)(struct ili9488_par *par, u8 *dst,
+                                  const void *vsrc, u32 x, u32 y, u32 n);
+
+static size_t conv_rgb565(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                          u32 x, u32 y, u32 n)
+{
+    const u16 *src = vsrc;
+    u32 i;
 
-        for (i = 0, k = 0; i < to_copy; i += 2)
-        {
-            uint32_t col = cur_offset % width;
-            uint32_t row = cur_offset / width;
+    for (i = 0; i < n; i++) {
+        *dst++ = src[i] >> 8;
+        *dst++ = src[i] & 0xFF;
+    }
 
-            uint8_t thr = dither_16x16[row % matrix_size][col % matrix_size];
+    return n * 2;
+}
 
-            txbuf[k] = 0;
-            if ((((vmem16[i] & 0xF800) >> 11) & 0xFF) > (thr + 4) / 8)
-            {
-                txbuf[k] |= color_red << 3;
-            }
+static size_t conv_3bit(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                        u32 x, u32 y, u32 n)
+{
+    const u16 *src = vsrc;
+    u32 i;
 
-            if ((((vmem16[i] & 0x07E0) >> 5) & 0xFF) > (thr + 2) / 4)
-            {
-                txbuf[k] |= color_green << 3;
-            }
+    for (i = 0; i < n; i += 2)
+        *dst++ = rgb565_to_3bit(src[i], 15, 31) << 3 |
+                 rgb565_to_3bit(src[i + 1], 15, 31);
 
-            if ((((vmem16[i] & 0x001F)) & 0xFF) > (thr + 4) / 8)
-            {
-                txbuf[k] |= color_blue << 3;
-            }
+    return n / 2;
+}
 
-            cur_offset++;
+static size_t conv_3bit_dither(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                               u32 x, u32 y, u32 n)
+{
+    const uint8_t *thr = dither_16x16[y % matrix_size];
+    const u16 *src = vsrc;
+    u8 t0, t1;
+    u32 i;
+
+    for (i = 0; i < n; i += 2) {
+        t0 = thr[(x + i) % matrix_size];
+        t1 = thr[(x + i + 1) % matrix_size];
+        *dst++ = rgb565_to_3bit(src[i], (t0 + 4) / 8, (t0 + 2) / 4) << 3 |
+                 rgb565_to_3bit(src[i + 1], (t1 + 4) / 8, (t1 + 2) / 4);
+    }
 
-            col = cur_offset % width;
-            row = cur_offset / width;
-            thr = dither_16x16[row % matrix_size][col % matrix_size];
+    return n / 2;
+}
 
-            if ((((vmem16[i + 1] & 0xF800) >> 11) & 0xFF) > (thr + 4) / 8)
-            {
-                txbuf[k] |= color_red;
-            }
+/*
+ * XRGB8888 vmem goes straight to the wire format, one pass over the
+ * damaged pixels with no intermediate RGB565 copy.
+ */
+static size_t conv_xrgb8888(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                            u32 x, u32 y, u32 n)
+{
+    const u32 *src = vsrc;
+    u32 i, c;
 
-            if ((((vmem16[i + 1] & 0x07E0) >> 5) & 0xFF) > (thr + 2) / 4)
-            {
-                txbuf[k] |= color_green;
-            }
+    for (i = 0; i < n; i++) {
+        c = src[i];
+        *dst++ = ((c >> 16) & 0xF8) | ((c >> 13) & 0x07);
+        *dst++ = ((c >> 5) & 0xE0) | ((c >> 3) & 0x1F);
+    }
 
-            if ((((vmem16[i + 1] & 0x001F)) & 0xFF) > (thr + 4) / 8)
-            {
-                txbuf[k] |= color_blue;
-            }
+    return n * 2;
+}
 
-            cur_offset++;
-            k++;
-        } 
+static size_t conv_xrgb8888_3bit(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                                 u32 x, u32 y, u32 n)
+{
+    const u32 *src = vsrc;
+    u32 i;
 
-        /* send batch to device */
-        fbtft_write_spi_wr(par, txbuf, to_copy / 2);
+    for (i = 0; i < n; i += 2)
+        *dst++ = xrgb8888_to_3bit(src[i], 127) << 3 |
+                 xrgb8888_to_3bit(src[i + 1], 127);
 
-        vmem16 = vmem16 + to_copy;
-        remain -= to_copy;
-    }
-    return 0;
+    return n / 2;
 }
 
-static int write_vmem_3bit(struct ili9488_par *par, size_t offset, size_t len)
+static size_t conv_xrgb8888_3bit_dither(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                                        u32 x, u32 y, u32 n)
 {
-    u16 *vmem16;
-    u8 *txbuf = par->txbuf.buf;
-    size_t remain;
-    size_t to_copy;
-    size_t tx_array_size;
-    int i;
-    int k;
-    size_t cur_offset = offset;
-    const size_t width = par->display->xres;
-    const uint8_t color_red = 1 << 2;
-    const uint8_t color_green = 1 << 1;
-    const uint8_t color_blue = 1 << 3;
+    const uint8_t *thr = dither_16x16[y % matrix_size];
+    const u32 *src = vsrc;
+    u32 i;
 
-    dev_dbg(par->dev, "%s, offset = %d, len = %d\n", __func__, offset, len);
+    for (i = 0; i < n; i += 2)
+        *dst++ = xrgb8888_to_3bit(src[i], thr[(x + i) % matrix_size]) << 3 |
+                 xrgb8888_to_3bit(src[i + 1], thr[(x + i + 1) % matrix_size]);
 
-    remain = len / 2;
-    vmem16 = (u16 *)(par->fbinfo->screen_buffer + offset);
+    return n / 2;
+}
 
-    gpio_put(par->gpio.dc, 1);
+static inline u16 xrgb8888_to_rgb565(u32 c)
+{
+    return ((c >> 8) & 0xF800) | ((c >> 5) & 0x07E0) | ((c >> 3) & 0x001F);
+}
 
-    /* non-buffered spi write */
-    if (!par->txbuf.buf)
-        return fbtft_write_spi_wr(par, vmem16, len);
+/*
+ * With a colour filter active every pixel is looked up in the 64K RGB565
+ * table while it is converted, there is no separate filter pass. bpp and
+ * dither are constants in each caller, so every variant is a tight loop.
+ */
+static __always_inline u16 lut_fetch(const u16 *lut, const void *src, u32 i, u32 bpp)
+{
+    if (bpp == 32)
+        return lut[xrgb8888_to_rgb565(((const u32 *)src)[i])];
+    return lut[((const u16 *)src)[i]];
+}
 
-    tx_array_size = par->txbuf.len / 3;
+static __always_inline size_t conv_lut(struct ili9488_par *par, u8 *dst,
+                                       const void *src, u32 n, u32 bpp)
+{
+    u32 i;
+    u16 c;
 
-    while (remain) {
-        to_copy = min(tx_array_size, remain);
-        dev_dbg(par->fbinfo->device, "to_copy=%zu, remain=%zu\n",
-                to_copy, remain - to_copy);
+    for (i = 0; i < n; i++) {
+        c = lut_fetch(par->lut, src, i, bpp);
+        *dst++ = c >> 8;
+        *dst++ = c & 0xFF;
+    }
 
-        for (i = 0, k = 0; i < to_copy; i += 2)
-        {
-            uint32_t col = cur_offset % width;
-            uint32_t row = cur_offset / width;
+    return n * 2;
+}
 
-            uint8_t thr = 8;
+static __always_inline size_t conv_lut_3bit(struct ili9488_par *par, u8 *dst,
+                                            const void *src, u32 x, u32 y,
+                                            u32 n, u32 bpp, bool dither)
+{
+    const uint8_t *thr = dither_16x16[y % matrix_size];
+    u8 rb0 = 15, g0 = 31, rb1 = 15, g1 = 31;
+    u32 i;
+
+    for (i = 0; i < n; i += 2) {
+        if (dither) {
+            rb0 = (thr[(x + i) % matrix_size] + 4) / 8;
+            g0 = (thr[(x + i) % matrix_size] + 2) / 4;
+            rb1 = (thr[(x + i + 1) % matrix_size] + 4) / 8;
+            g1 = (thr[(x + i + 1) % matrix_size] + 2) / 4;
+        }
+        *dst++ = rgb565_to_3bit(lut_fetch(par->lut, src, i, bpp), rb0, g0) << 3 |
+                 rgb565_to_3bit(lut_fetch(par->lut, src, i + 1, bpp), rb1, g1);
+    }
 
-            txbuf[k] = 0;
-            if ((((vmem16[i] & 0xF800) >> 11) & 0xFF) >= thr * 2)
-            {
-                txbuf[k] |= color_red << 3;
-            }
+    return n / 2;
+}
 
-            if ((((vmem16[i] & 0x07E0) >> 5) & 0xFF) >= thr * 4)
-            {
-                txbuf[k] |= color_green << 3;
-            }
+static size_t conv_rgb565_lut(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                              u32 x, u32 y, u32 n)
+{
+    return conv_lut(par, dst, vsrc, n, 16);
+}
 
-            if ((((vmem16[i] & 0x001F)) & 0xFF) >= thr * 2)
-            {
-                txbuf[k] |= color_blue << 3;
-            }
+static size_t conv_3bit_lut(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                            u32 x, u32 y, u32 n)
+{
+    return conv_lut_3bit(par, dst, vsrc, x, y, n, 16, false);
+}
 
-            cur_offset++;
+static size_t conv_3bit_dither_lut(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                                   u32 x, u32 y, u32 n)
+{
+    return conv_lut_3bit(par, dst, vsrc, x, y, n, 16, true);
+}
 
-            col = cur_offset % width;
-            row = cur_offset / width;
+static size_t conv_xrgb8888_lut(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                                u32 x, u32 y, u32 n)
+{
+    return conv_lut(par, dst, vsrc, n, 32);
+}
 
-            if ((((vmem16[i + 1] & 0xF800) >> 11) & 0xFF) >= thr * 2)
-            {
-                txbuf[k] |= color_red;
-            }
+static size_t conv_xrgb8888_3bit_lut(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                                     u32 x, u32 y, u32 n)
+{
+    return conv_lut_3bit(par, dst, vsrc, x, y, n, 32, false);
+}
 
-            if ((((vmem16[i + 1] & 0x07E0) >> 5) & 0xFF) >= thr * 4)
-            {
-                txbuf[k] |= color_green;
-            }
+static size_t conv_xrgb8888_3bit_dither_lut(struct ili9488_par *par, u8 *dst,
+                                            const void *vsrc, u32 x, u32 y, u32 n)
+{
+    return conv_lut_3bit(par, dst, vsrc, x, y, n, 32, true);
+}
 
-            if ((((vmem16[i + 1] & 0x001F)) & 0xFF) >= thr * 2)
-            {
-                txbuf[k] |= color_blue;
-            }
+/* 8bpp indices are expanded through the palette on the fly */
+static size_t conv_c8(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                      u32 x, u32 y, u32 n)
+{
+    const u8 *src = vsrc;
+    u32 i;
+    u16 c;
+
+    for (i = 0; i < n; i++) {
+        c = par->palette[src[i]];
+        *dst++ = c >> 8;
+        *dst++ = c & 0xFF;
+    }
 
-            cur_offset++;
-            k++;
-        } 
+    return n * 2;
+}
 
-        /* send batch to device */
-        fbtft_write_spi_wr(par, txbuf, to_copy / 2);
+static size_t conv_c8_3bit(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                           u32 x, u32 y, u32 n)
+{
+    const u8 *src = vsrc;
+    u32 i;
 
-        vmem16 = vmem16 + to_copy;
-        remain -= to_copy;
-    }
-    return 0;
+    for (i = 0; i < n; i += 2)
+        *dst++ = par->palette_3bit[src[i]] << 3 | par->palette_3bit[src[i + 1]];
+
+    return n / 2;
 }
 
-static int write_vmem(struct ili9488_par *par, size_t offset, size_t len)
+static size_t conv_c8_3bit_dither(struct ili9488_par *par, u8 *dst, const void *vsrc,
+                                  u32 x, u32 y, u32 n)
 {
-    u16 *vmem16;
-    u8 *txbuf = par->txbuf.buf;
-    size_t remain;
-    size_t to_copy;
-    size_t tx_array_size;
-    int i;
-    int k;
+    const uint8_t *thr = dither_16x16[y % matrix_size];
+    const u8 *src = vsrc;
+    u8 t0, t1;
+    u32 i;
+
+    for (i = 0; i < n; i += 2) {
+        t0 = thr[(x + i) % matrix_size];
+        t1 = thr[(x + i + 1) % matrix_size];
+        *dst++ = rgb565_to_3bit(par->palette[src[i]], (t0 + 4) / 8, (t0 + 2) / 4) << 3 |
+                 rgb565_to_3bit(par->palette[src[i + 1]], (t1 + 4) / 8, (t1 + 2) / 4);
+    }
 
-    dev_dbg(par->dev, "%s, offset = %d, len = %d\n", __func__, offset, len);
+    return n / 2;
+}
 
-    remain = len / 2;
-    vmem16 = (u16 *)(par->fbinfo->screen_buffer + offset);
+/*
+ * Pick the converter from a source of bpp bits to the current wire format.
+ * The 8bpp palette is filtered when it is built, so it needs no LUT variant.
+ */
+static ili9488_conv_fn ili9488_conv_select_bpp(struct ili9488_par *par, u32 bpp,
+                                               u32 width, size_t *row_bytes)
+{
+    const bool lut = par->lut && bpp != 8;
+
+    if (par->mode.three_bit) {
+        *row_bytes = width / 2;
+        if (bpp == 8)
+            return par->mode.dither ? conv_c8_3bit_dither : conv_c8_3bit;
+        if (bpp == 32 && lut)
+            return par->mode.dither ? conv_xrgb8888_3bit_dither_lut : conv_xrgb8888_3bit_lut;
+        if (bpp == 32)
+            return par->mode.dither ? conv_xrgb8888_3bit_dither : conv_xrgb8888_3bit;
+        if (lut)
+            return par->mode.dither ? conv_3bit_dither_lut : conv_3bit_lut;
+        return par->mode.dither ? conv_3bit_dither : conv_3bit;
+    }
 
-    gpio_put(par->gpio.dc, 1);
+    *row_bytes = width * 2;
+    if (bpp == 8)
+        return conv_c8;
+    if (bpp == 32)
+        return lut ? conv_xrgb8888_lut : conv_xrgb8888;
+    return lut ? conv_rgb565_lut : conv_rgb565;
+}
 
-    /* non-buffered spi write */
-    if (!par->txbuf.buf)
-        return fbtft_write_spi_wr(par, vmem16, len);
+static ili9488_conv_fn ili9488_conv_select(struct ili9488_par *par, u32 width,
+                                           size_t *row_bytes)
+{
+    return ili9488_conv_select_bpp(par, par->fbinfo->var.bits_per_pixel,
+                                   width, row_bytes);
+}
 
-    tx_array_size = par->txbuf.len / 3;
+/* expand one palette entry, through the colour filter when one is set */
+static void ili9488_palette_expand(struct ili9488_par *par, u32 regno)
+{
+    const u16 *lut = par->lut;
+    u16 c = par->palette_raw[regno];
 
-    while (remain) {
-        to_copy = min(tx_array_size, remain);
-        dev_dbg(par->fbinfo->device, "to_copy=%zu, remain=%zu\n",
-                to_copy, remain - to_copy);
+    if (lut)
+        c = lut[c];
+    par->palette[regno] = c;
+    par->palette_3bit[regno] = rgb565_to_3bit(c, 15, 31);
+}
 
-        for (i = 0, k = 0; i < to_copy; i++)
-        {
-            txbuf[k++] = ((vmem16[i] & 0xFF00) >> 8) & 0xFF;
-            txbuf[k++] = (vmem16[i] & 0x00FF);
-            //txbuf[k++] = ((vmem16[i] & 0x001F) << 3) & 0xFF;
-            // txbuf[k++] = 255;
-            // txbuf[k++] = 0;
-            // txbuf[k++] = 0;
-        } 
+static inline const void *ili9488_vmem_addr(struct ili9488_par *par, u32 x, u32 y)
+{
+    struct fb_info *info = par->fbinfo;
 
-//        memcpy(txbuf, vmem16, to_copy * 2);
+    return info->screen_buffer + y * info->fix.line_length +
+           x * (info->var.bits_per_pixel / BITS_PER_BYTE);
+}
 
-        /* send batch to device */
-        fbtft_write_spi_wr(par, txbuf, to_copy * 2);
+/* account the time spent in the previous state, called with io_lock held */
+static void ili9488_pm_set_state(struct ili9488_par *par,
+                                 enum ili9488_pm_state state)
+{
+    ktime_t now = ktime_get();
 
-        vmem16 = vmem16 + to_copy;
-        remain -= to_copy;
-    }
-    return 0;
+    par->pm.time_ns[par->pm.state] += ktime_to_ns(ktime_sub(now, par->pm.since));
+    par->pm.entries[state]++;
+    par->pm.state = state;
+    par->pm.since = now;
 }
 
-static void update_display(struct ili9488_par *par, unsigned int start_line,
-                           unsigned int end_line)
+/*
+ * Called with io_lock held before the first command after a resume. The
+ * resume callback only started the exit, whatever the caller did since
+ * then (converting the first batch) is taken off the wait.
+ */
+static void ili9488_pm_wake_wait(struct ili9488_par *par)
 {
-    size_t offset, len;
+    ktime_t start = ktime_get();
+    s64 wait_ns, hidden_ns;
+    bool blanked;
 
-    dev_dbg(par->dev, "%s, start_line : %d, end_line : %d\n", __func__, start_line, end_line);
+    if (!par->pm.waking)
+        return;
 
-    // par->tftops->idle(par, false);
-    /* write vmem to display then call refresh routine */
-    /*
+    wait_ns = ktime_to_ns(ktime_sub(par->pm.wake_ready, start));
+    if (wait_ns > 0)
+        usleep_range(wait_ns / NSEC_PER_USEC, wait_ns / NSEC_PER_USEC + 100);
+    else
+        wait_ns = 0;
+    hidden_ns = ktime_to_ns(ktime_sub(par->pm.wake_ready, par->pm.wake_start)) - wait_ns;
+    wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    spin_lock(&par->dirty_lock);
+    blanked = par->blanked;
+    spin_unlock(&par->dirty_lock);
+
+    /* sleep in turned the display off, unblank does this itself */
+    if (par->pm.wake_from == ILI9488_PM_SLEEP && !blanked)
+        par->tftops->blank(par, false);
+
+    par->pm.waking = false;
+    par->pm.wakes++;
+    par->pm.wake_wait_total_ns += wait_ns;
+    par->pm.wake_wait_max_ns = max_t(u64, par->pm.wake_wait_max_ns, wait_ns);
+    par->pm.wake_hidden_total_ns += max_t(s64, hidden_ns, 0);
+}
+
+/*
+ * The window is only opened once the first batch is converted, so a panel
+ * still coming out of sleep has that much longer to get ready.
+ */
+static void ili9488_vmem_begin(struct ili9488_par *par, u32 xs, u32 ys,
+                               u32 xe, u32 ye)
+{
+    ili9488_pm_wake_wait(par);
+
+    gpio_put(par->gpio.cs, 0);
+    par->tftops->set_addr_win(par, xs, ys, xe, ye);
+    gpio_put(par->gpio.dc, 1);
+}
+
+/*
+ * Checked by the flush thread right before rows ys..ye go out. A frame
+ * submitted since the flush collected its damage, covering all of them,
+ * makes sending them wasted work: its own flush is already queued.
+ */
+static bool ili9488_frame_superseded(struct ili9488_par *par, u32 ys, u32 ye)
+{
+    bool superseded;
+
+    spin_lock(&par->dirty_lock);
+    superseded = par->frames.flushing && par->frames.pending &&
+                 par->frames.ys <= ys && par->frames.ye >= ye;
+    if (superseded)
+        par->frames.superseded++;
+    spin_unlock(&par->dirty_lock);
+
+    return superseded;
+}
+
+/*
+ * Convert the vmem rectangle in batches of rows and stream it to the
+ * panel. Returns -EAGAIN when a newer frame superseded the rows left,
+ * checked before each batch is converted.
+ */
+static int write_vmem(struct ili9488_par *par, u32 xs, u32 ys, u32 xe, u32 ye)
+{
+    const u32 width = xe - xs + 1;
+    u8 *txbuf = par->txbuf.buf;
+    ili9488_conv_fn conv;
+    bool started = false;
+    size_t row_bytes, batch;
+    size_t k = 0;
+    u32 y;
+
+    dev_dbg(par->dev, "%s, x = %u..%u, y = %u..%u\n", __func__, xs, xe, ys, ye);
+
+    conv = ili9488_conv_select(par, width, &row_bytes);
+    batch = clamp_t(size_t, ILI9488_FLUSH_BATCH, row_bytes, par->txbuf.len);
+
+    for (y = ys; y <= ye; y++) {
+        if (!k && ili9488_frame_superseded(par, y, ye))
+            goto superseded;
+
+        k += conv(par, txbuf + k, ili9488_vmem_addr(par, xs, y), xs, y, width);
+
+        /* send batch to device */
+        if (y == ye || k + row_bytes > batch) {
+            if (!started) {
+                ili9488_vmem_begin(par, xs, ys, xe, ye);
+                started = true;
+            }
+            fbtft_write_spi_wr(par, txbuf, k);
+            par->stats.flush_bytes += k;
+            k = 0;
+        }
+    }
+    gpio_put(par->gpio.cs, 1);
+
+    return 0;
+
+superseded:
+    if (started)
+        gpio_put(par->gpio.cs, 1);
+    return -EAGAIN;
+}
+
+/* tell the damage readers which part of vmem just went to the panel */
+static void ili9488_damage_publish(struct ili9488_par *par, u32 xs, u32 ys,
+                                   u32 xe, u32 ye)
+{
+    struct ili9488_damage_hub *hub = par->damage.hub;
+    struct ili9488_damage ev = {
+        .seq            = par->damage.seq,
+        .x              = xs,
+        .y              = ys,
+        .width          = xe - xs + 1,
+        .height         = ye - ys + 1,
+        .timestamp_ns   = ktime_get_ns(),
+    };
+    struct ili9488_damage_reader *reader;
+    bool wake;
+
+    spin_lock(&hub->lock);
+    hub->seq = ev.seq;
+    hub->xres = par->fbinfo->var.xres;
+    hub->yres = par->fbinfo->var.yres;
+    wake = !list_empty(&hub->readers);
+    list_for_each_entry(reader, &hub->readers, node) {
+        if (!kfifo_put(&reader->fifo, ev))
+            reader->overflow = true;
+    }
+    spin_unlock(&hub->lock);
+
+    if (wake)
+        wake_up_interruptible(&hub->wait);
+}
+
+/* rows outside the partial band are not driven, so they are not sent either */
+static bool ili9488_partial_clip(struct ili9488_par *par, u32 *ys, u32 *ye)
+{
+    if (!par->partial.on)
+        return true;
+
+    *ys = max(*ys, par->partial.ys);
+    *ye = min(*ye, par->partial.ye);
+
+    return *ys <= *ye;
+}
+
+static void update_display(struct ili9488_par *par, u32 xs, u32 ys,
+                           u32 xe, u32 ye)
+{
+    const u32 xmax = par->fbinfo->var.xres - 1;
+    const u32 ymax = par->fbinfo->var.yres - 1;
+
+    dev_dbg(par->dev, "%s, x : %d..%d, y : %d..%d\n", __func__, xs, xe, ys, ye);
+
+    /* write vmem to display then call refresh routine */
+    /*
      * when this was called, driver should wait for busy pin comes low
      * until next frame refreshed
      */
-    if (start_line > end_line) {
-        dev_dbg(par->dev, "start line never should bigger than end line !!!!!\n");
-        start_line = 0;
-        end_line = par->fbinfo->var.yres - 1;
+    if (xs > xe || ys > ye) {
+        dev_dbg(par->dev, "start never should bigger than end !!!!!\n");
+        xs = ys = 0;
+        xe = xmax;
+        ye = ymax;
     }
 
-    if (start_line > par->fbinfo->var.yres - 1 ||
-        end_line > par->fbinfo->var.yres - 1) {
-        dev_dbg(par->dev, "invaild start line or end line !!!!!\n");
-        start_line = 0;
-        end_line = par->fbinfo->var.yres - 1;
+    if (xe > xmax || ye > ymax) {
+        dev_dbg(par->dev, "invaild end column or end line !!!!!\n");
+        xs = ys = 0;
+        xe = xmax;
+        ye = ymax;
     }
 
-    /* for each column, refresh dirty rows */
+    if (!ili9488_partial_clip(par, &ys, &ye))
+        return;
 
-    gpio_put(par->gpio.cs, 0);
-    par->tftops->set_addr_win(par, 0, start_line, par->fbinfo->var.xres - 1, end_line);
+    /* two pixels share a byte in 3 bit mode */
+    if (par->mode.three_bit) {
+        xs &= ~1;
+        xe |= 1;
+    }
 
-    offset = start_line * par->fbinfo->fix.line_length;
-    len = (end_line - start_line + 1) * par->fbinfo->fix.line_length;
+    /* superseded rows are published by the flush that sends them */
+    if (!write_vmem(par, xs, ys, xe, ye))
+        ili9488_damage_publish(par, xs, ys, xe, ye);
+}
 
-    if (p_3bit_mode)
-    {
-        if (p_dither)
-            write_vmem_3bit_dither(par, offset, len);
-	else
-            write_vmem_3bit(par, offset, len);
+/*
+ * Queue a flush on the driver's own worker instead of the shared system
+ * workqueue, so frames are not held up behind unrelated work items.
+ * The first damage after a flush arms the work, later damage piggybacks.
+ */
+static void ili9488_queue_flush(struct ili9488_par *par, unsigned long delay)
+{
+    spin_lock(&par->dirty_lock);
+    if (!par->flush_pending && !par->blanked) {
+        par->flush_pending = true;
+        par->flush_due = ktime_add_ns(ktime_get(), jiffies_to_nsecs(delay));
+        kthread_queue_delayed_work(par->flush_worker, &par->flush_work, delay);
     }
+    spin_unlock(&par->dirty_lock);
+}
+
+/* account one application frame covering lines ys..ye, dirty_lock held */
+static void ili9488_frame_account(struct ili9488_par *par, u32 ys, u32 ye)
+{
+    par->frames.submitted++;
+
+    if (!par->frames.pending) {
+        par->frames.pending = true;
+        par->frames.ys = ys;
+        par->frames.ye = ye;
+        return;
+    }
+
+    if (ys <= par->frames.ys && ye >= par->frames.ye)
+        par->frames.dropped++;
     else
-    {
-        write_vmem(par, offset, len);
+        par->frames.merged++;
+    par->frames.ys = min(par->frames.ys, ys);
+    par->frames.ye = max(par->frames.ye, ye);
+}
+
+/* called with dirty_lock held, turns the dirty cell grid into row extents */
+static void ili9488_tile_collect(struct ili9488_par *par)
+{
+    struct ili9488_tile *tile = &par->tile;
+    unsigned long bit, end;
+    u32 r;
+
+    tile->flush_width = tile->width;
+    tile->flush_height = tile->height;
+    tile->flush_rows = tile->rows;
+
+    for (r = 0; r < tile->rows; r++) {
+        end = (r + 1) * tile->cols;
+        bit = find_next_bit(tile->dirty, end, r * tile->cols);
+        if (bit >= end) {
+            tile->row_first[r] = U16_MAX;
+            continue;
+        }
+
+        tile->row_first[r] = bit - r * tile->cols;
+        for_each_set_bit_from(bit, tile->dirty, end)
+            tile->row_last[r] = bit - r * tile->cols;
+        bitmap_clear(tile->dirty, r * tile->cols, tile->cols);
+    }
+}
+
+/*
+ * Push the collected cell rows that are not already covered by the line
+ * range being flushed. Consecutive rows with the same extents (a console
+ * redraw or scroll) go out as a single window.
+ */
+static void ili9488_tile_flush(struct ili9488_par *par, u32 skip_start,
+                               u32 skip_end)
+{
+    struct ili9488_tile *tile = &par->tile;
+    const u32 w = tile->flush_width, h = tile->flush_height;
+    u32 r = 0, next, ys, ye;
+
+    while (r < tile->flush_rows) {
+        next = r + 1;
+        if (tile->row_first[r] == U16_MAX) {
+            r = next;
+            continue;
+        }
+
+        while (next < tile->flush_rows &&
+               tile->row_first[next] == tile->row_first[r] &&
+               tile->row_last[next] == tile->row_last[r])
+            next++;
+
+        ys = r * h;
+        ye = next * h - 1;
+        if (skip_start > skip_end || ys < skip_start || ye > skip_end)
+            update_display(par, tile->row_first[r] * w, ys,
+                           (tile->row_last[r] + 1) * w - 1, ye);
+        r = next;
+    }
+}
+
+static void ili9488_flush_work(struct kthread_work *work)
+{
+    struct ili9488_par *par = container_of(work, struct ili9488_par,
+                                           flush_work.work);
+    unsigned int dirty_lines_start, dirty_lines_end;
+    ktime_t start = ktime_get();
+    u64 delay_ns, flush_ns;
+    bool blanked;
+    int rc;
+
+    spin_lock(&par->dirty_lock);
+    delay_ns = max_t(s64, ktime_to_ns(ktime_sub(start, par->flush_due)), 0);
+    par->flush_pending = false;
+    blanked = par->blanked;
+    spin_unlock(&par->dirty_lock);
+    /* keep the damage, unblank flushes it in one go */
+    if (blanked)
+        return;
+
+    /*
+     * Resuming only starts the panel exit, write_vmem() waits for it. If
+     * it fails the damage is left in place for the next flush.
+     */
+    rc = pm_runtime_resume_and_get(par->dev);
+    if (rc < 0) {
+        dev_err_ratelimited(par->dev, "flush: runtime resume failed: %d\n", rc);
+        return;
+    }
+
+    spin_lock(&par->dirty_lock);
+    if (par->blanked) {
+        spin_unlock(&par->dirty_lock);
+        pm_runtime_put_autosuspend(par->dev);
+        return;
+    }
+    dirty_lines_start = par->dirty_lines_start;
+    dirty_lines_end = par->dirty_lines_end;
+
+    /* clean dirty markers */
+    par->dirty_lines_start = par->fbinfo->var.yres - 1;
+    par->dirty_lines_end = 0;
+    ili9488_tile_collect(par);
+    if (par->frames.pending) {
+        par->frames.pending = false;
+        par->frames.flushed++;
+    }
+    par->frames.flushing = true;
+    spin_unlock(&par->dirty_lock);
+
+    par->damage.seq++;
+
+    mutex_lock(&par->io_lock);
+    if (dirty_lines_start <= dirty_lines_end)
+        update_display(par, 0, dirty_lines_start,
+                       par->fbinfo->var.xres - 1, dirty_lines_end);
+    ili9488_tile_flush(par, dirty_lines_start, dirty_lines_end);
+    ili9488_pm_wake_wait(par);
+    spin_lock(&par->dirty_lock);
+    par->frames.flushing = false;
+    spin_unlock(&par->dirty_lock);
+    mutex_unlock(&par->io_lock);
+    pm_runtime_mark_last_busy(par->dev);
+    pm_runtime_put_autosuspend(par->dev);
+
+    flush_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    par->stats.flushes++;
+    par->stats.sched_delay_total_ns += delay_ns;
+    par->stats.sched_delay_max_ns = max(par->stats.sched_delay_max_ns, delay_ns);
+    par->stats.flush_total_ns += flush_ns;
+    par->stats.flush_max_ns = max(par->stats.flush_max_ns, flush_ns);
+}
+
+/*
+ * Send one cursor cell straight to the panel. The cell is small enough to
+ * be converted into its own buffer and sent with a prepared single
+ * transfer message, without touching the flush txbuf or dirty state.
+ */
+static void ili9488_cursor_write(struct ili9488_par *par, const struct ili9488_rect *r)
+{
+    u32 xs = r->xs, ys = r->ys;
+    u32 xe = min(r->xe, par->fbinfo->var.xres - 1);
+    u32 ye = min(r->ye, par->fbinfo->var.yres - 1);
+    ili9488_conv_fn conv;
+    size_t row_bytes;
+    size_t k = 0;
+    u32 y;
+
+    if (xs > xe || ys > ye)
+        return;
+
+    if (par->mode.three_bit) {
+        xs &= ~1;
+        xe |= 1;
     }
 
+    conv = ili9488_conv_select(par, xe - xs + 1, &row_bytes);
+    if (row_bytes * (ye - ys + 1) > ILI9488_CURSOR_BUF) {
+        update_display(par, xs, ys, xe, ye);
+        return;
+    }
+
+    if (!ili9488_partial_clip(par, &ys, &ye))
+        return;
+
+    for (y = ys; y <= ye; y++)
+        k += conv(par, par->cursor.buf + k, ili9488_vmem_addr(par, xs, y),
+                  xs, y, xe - xs + 1);
+
+    ili9488_vmem_begin(par, xs, ys, xe, ye);
+    par->cursor.xfer.len = k;
+    spi_sync(par->spi, &par->cursor.msg);
     gpio_put(par->gpio.cs, 1);
+    ili9488_damage_publish(par, xs, ys, xe, ye);
+
+    par->stats.cursor_pushes++;
+    par->stats.cursor_bytes += k;
+}
+
+static void ili9488_cursor_work(struct kthread_work *work)
+{
+    struct ili9488_par *par = container_of(work, struct ili9488_par, cursor.work);
+    struct ili9488_rect rects[ILI9488_CURSOR_RECTS];
+    bool asleep;
+    u32 i, n;
+    int rc;
+
+    /*
+     * A blinking cursor alone must not keep the panel out of idle, pushes
+     * do not count as activity for autosuspend. Idle still shows memory
+     * writes, so the cells go out without waking the panel. Only a
+     * sleeping panel, which shows nothing, leaves them for the next flush.
+     */
+    rc = pm_runtime_get_if_active(par->dev, true);
+
+    mutex_lock(&par->io_lock);
+    asleep = !rc && par->pm.state == ILI9488_PM_SLEEP;
+
+    spin_lock(&par->dirty_lock);
+    n = par->cursor.npending;
+    memcpy(rects, par->cursor.pending, n * sizeof(rects[0]));
+    par->cursor.npending = 0;
+    if (asleep) {
+        for (i = 0; i < n; i++) {
+            par->dirty_lines_start = min(par->dirty_lines_start, rects[i].ys);
+            par->dirty_lines_end = max(par->dirty_lines_end,
+                                       min(rects[i].ye, par->fbinfo->var.yres - 1));
+        }
+    }
+    spin_unlock(&par->dirty_lock);
+
+    if (!asleep) {
+        par->damage.seq++;
+        for (i = 0; i < n; i++)
+            ili9488_cursor_write(par, &rects[i]);
+    }
+    mutex_unlock(&par->io_lock);
+
+    if (rc > 0)
+        pm_runtime_put_autosuspend(par->dev);
+}
+
+/*
+ * Send a converted video frame. Frames converted before a wire format
+ * switch are dropped, the next one will be in the new format.
+ */
+static void ili9488_video_work(struct kthread_work *work)
+{
+    struct ili9488_par *par = container_of(work, struct ili9488_par, video.work);
+    const struct ili9488_rect *r = &par->video.rect;
+    u32 ys = r->ys, ye = r->ye;
+    bool blanked;
+    size_t len;
+
+    spin_lock(&par->dirty_lock);
+    blanked = par->blanked;
+    spin_unlock(&par->dirty_lock);
+    if (blanked)
+        goto done;
+
+    if (pm_runtime_resume_and_get(par->dev) < 0) {
+        par->stats.video_dropped++;
+        goto done;
+    }
+    mutex_lock(&par->io_lock);
+    if (par->video.three_bit != par->mode.three_bit) {
+        par->stats.video_dropped++;
+    } else if (ili9488_partial_clip(par, &ys, &ye)) {
+        len = (ye - ys + 1) * par->video.row_bytes;
+        ili9488_vmem_begin(par, r->xs, ys, r->xe, ye);
+        fbtft_write_spi_wr(par, par->video.pending + (ys - r->ys) * par->video.row_bytes,
+                           len);
+        gpio_put(par->gpio.cs, 1);
+
+        par->stats.video_frames++;
+        par->stats.video_bytes += len;
+    }
+    ili9488_pm_wake_wait(par);
+    mutex_unlock(&par->io_lock);
+    pm_runtime_mark_last_busy(par->dev);
+    pm_runtime_put_autosuspend(par->dev);
+
+done:
+    complete_all(&par->complete);
+}
+
+static int ili9488_flush_worker_init(struct ili9488_par *par)
+{
+    struct kthread_worker *worker;
+    int rc;
+
+    if (p_flush_cpu >= 0 && cpu_online(p_flush_cpu))
+        worker = kthread_create_worker_on_cpu(p_flush_cpu, 0,
+                                              "ili9488_flush/%d", p_flush_cpu);
+    else
+        worker = kthread_create_worker(0, "ili9488_flush");
+    if (IS_ERR(worker))
+        return PTR_ERR(worker);
+
+    if (p_flush_prio > 0) {
+        struct sched_attr attr = {
+            .size           = sizeof(attr),
+            .sched_policy   = SCHED_FIFO,
+            .sched_priority = clamp(p_flush_prio, 1, MAX_RT_PRIO - 1),
+        };
+
+        rc = sched_setattr_nocheck(worker->task, &attr);
+        if (rc)
+            dev_warn(par->dev, "failed to set flush thread priority: %d\n", rc);
+    }
+
+    kthread_init_delayed_work(&par->flush_work, ili9488_flush_work);
+    kthread_init_work(&par->cursor.work, ili9488_cursor_work);
+    kthread_init_work(&par->video.work, ili9488_video_work);
+    par->flush_worker = worker;
+
+    return 0;
+}
+
+static void ili9488_flush_worker_destroy(struct ili9488_par *par)
+{
+    kthread_cancel_delayed_work_sync(&par->flush_work);
+    kthread_cancel_work_sync(&par->cursor.work);
+    kthread_cancel_work_sync(&par->video.work);
+    kthread_destroy_worker(par->flush_worker);
+    complete_all(&par->complete);
+}
+
+static const char * const ili9488_pm_names[ILI9488_PM_NR] = {
+    [ILI9488_PM_ACTIVE] = "active",
+    [ILI9488_PM_IDLE]   = "idle",
+    [ILI9488_PM_SLEEP]  = "sleep",
+};
+
+static int ili9488_stats_show(struct seq_file *m, void *v)
+{
+    struct ili9488_par *par = m->private;
+    u64 flushes = par->stats.flushes;
+    u64 time_ns[ILI9488_PM_NR];
+    enum ili9488_pm_state state;
+    u64 wakes;
+    int i;
+
+    seq_printf(m, "flushes:            %llu\n", flushes);
+    seq_printf(m, "sched_delay_avg_us: %llu\n",
+               flushes ? div64_u64(par->stats.sched_delay_total_ns, flushes) / NSEC_PER_USEC : 0);
+    seq_printf(m, "sched_delay_max_us: %llu\n",
+               div_u64(par->stats.sched_delay_max_ns, NSEC_PER_USEC));
+    seq_printf(m, "flush_avg_us:       %llu\n",
+               flushes ? div64_u64(par->stats.flush_total_ns, flushes) / NSEC_PER_USEC : 0);
+    seq_printf(m, "flush_max_us:       %llu\n",
+               div_u64(par->stats.flush_max_ns, NSEC_PER_USEC));
+    seq_printf(m, "flush_bytes:        %llu\n", par->stats.flush_bytes);
+    seq_printf(m, "cursor_pushes:      %llu\n", par->stats.cursor_pushes);
+    seq_printf(m, "cursor_bytes:       %llu\n", par->stats.cursor_bytes);
+    seq_printf(m, "video_frames:       %llu\n", par->stats.video_frames);
+    seq_printf(m, "video_bytes:        %llu\n", par->stats.video_bytes);
+    seq_printf(m, "video_dropped:      %llu\n", par->stats.video_dropped);
+
+    spin_lock(&par->dirty_lock);
+    seq_printf(m, "frames_submitted:   %llu\n", par->frames.submitted);
+    seq_printf(m, "frames_flushed:     %llu\n", par->frames.flushed);
+    seq_printf(m, "frames_merged:      %llu\n", par->frames.merged);
+    seq_printf(m, "frames_dropped:     %llu\n", par->frames.dropped);
+    seq_printf(m, "frames_superseded:  %llu\n", par->frames.superseded);
+    spin_unlock(&par->dirty_lock);
+
+    mutex_lock(&par->io_lock);
+    state = par->pm.state;
+    memcpy(time_ns, par->pm.time_ns, sizeof(time_ns));
+    time_ns[state] += ktime_to_ns(ktime_sub(ktime_get(), par->pm.since));
+    mutex_unlock(&par->io_lock);
+    wakes = par->pm.wakes;
+
+    seq_printf(m, "pm_state:           %s\n", ili9488_pm_names[state]);
+    for (i = 0; i < ILI9488_PM_NR; i++)
+        seq_printf(m, "pm_%s_ms: %llu, entries %llu\n", ili9488_pm_names[i],
+                   div_u64(time_ns[i], NSEC_PER_MSEC), par->pm.entries[i]);
+    seq_printf(m, "pm_wakes:           %llu\n", wakes);
+    seq_printf(m, "pm_wake_wait_avg_us: %llu\n",
+               wakes ? div64_u64(par->pm.wake_wait_total_ns, wakes) / NSEC_PER_USEC : 0);
+    seq_printf(m, "pm_wake_wait_max_us: %llu\n",
+               div_u64(par->pm.wake_wait_max_ns, NSEC_PER_USEC));
+    seq_printf(m, "pm_wake_hidden_avg_us: %llu\n",
+               wakes ? div64_u64(par->pm.wake_hidden_total_ns, wakes) / NSEC_PER_USEC : 0);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ili9488_stats);
+
+static void ili9488_damage_hub_free(struct kref *ref)
+{
+    kfree(container_of(ref, struct ili9488_damage_hub, ref));
+}
+
+static struct ili9488_damage_hub *ili9488_damage_hub_alloc(void)
+{
+    struct ili9488_damage_hub *hub;
+
+    hub = kzalloc(sizeof(*hub), GFP_KERNEL);
+    if (!hub)
+        return NULL;
+
+    kref_init(&hub->ref);
+    spin_lock_init(&hub->lock);
+    INIT_LIST_HEAD(&hub->readers);
+    init_waitqueue_head(&hub->wait);
+
+    return hub;
+}
+
+/* after misc_deregister() and the last publish, wakes readers up to EOF */
+static void ili9488_damage_hub_kill(struct ili9488_damage_hub *hub)
+{
+    if (!hub)
+        return;
+
+    spin_lock(&hub->lock);
+    hub->dead = true;
+    spin_unlock(&hub->lock);
+    wake_up_interruptible(&hub->wait);
+
+    kref_put(&hub->ref, ili9488_damage_hub_free);
+}
+
+/* misc_deregister() waits for running opens, the hub is still referenced by par */
+static int ili9488_damage_open(struct inode *inode, struct file *file)
+{
+    struct ili9488_par *par = container_of(file->private_data, struct ili9488_par,
+                                           damage.misc);
+    struct ili9488_damage_hub *hub = par->damage.hub;
+    struct ili9488_damage_reader *reader;
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader)
+        return -ENOMEM;
+
+    reader->hub = hub;
+    INIT_KFIFO(reader->fifo);
+
+    kref_get(&hub->ref);
+    spin_lock(&hub->lock);
+    list_add_tail(&reader->node, &hub->readers);
+    spin_unlock(&hub->lock);
+
+    file->private_data = reader;
+
+    return stream_open(inode, file);
+}
+
+static int ili9488_damage_release(struct inode *inode, struct file *file)
+{
+    struct ili9488_damage_reader *reader = file->private_data;
+    struct ili9488_damage_hub *hub = reader->hub;
+
+    spin_lock(&hub->lock);
+    list_del(&reader->node);
+    spin_unlock(&hub->lock);
+    kfree(reader);
+    kref_put(&hub->ref, ili9488_damage_hub_free);
+
+    return 0;
+}
+
+/* called with hub->lock held, a lost record turns into one full screen record */
+static u32 ili9488_damage_take(struct ili9488_damage_reader *reader,
+                               struct ili9488_damage *ev, u32 n)
+{
+    struct ili9488_damage_hub *hub = reader->hub;
+
+    if (!reader->overflow)
+        return kfifo_out(&reader->fifo, ev, n);
+
+    memset(ev, 0, sizeof(*ev));
+    ev->seq = hub->seq;
+    ev->flags = ILI9488_DAMAGE_OVERFLOW;
+    ev->width = hub->xres;
+    ev->height = hub->yres;
+    ev->timestamp_ns = ktime_get_ns();
+    kfifo_reset(&reader->fifo);
+    reader->overflow = false;
+
+    return 1;
+}
+
+static bool ili9488_damage_ready(struct ili9488_damage_reader *reader)
+{
+    struct ili9488_damage_hub *hub = reader->hub;
+    bool ready;
 
-    // par->tftops->idle(par, true);
+    spin_lock(&hub->lock);
+    ready = hub->dead || reader->overflow || !kfifo_is_empty(&reader->fifo);
+    spin_unlock(&hub->lock);
+
+    return ready;
+}
+
+/* records still queued when the panel goes away are read first, then EOF */
+static ssize_t ili9488_damage_read(struct file *file, char __user *buf,
+                                   size_t count, loff_t *ppos)
+{
+    struct ili9488_damage_reader *reader = file->private_data;
+    struct ili9488_damage_hub *hub = reader->hub;
+    struct ili9488_damage ev[16];
+    u32 n = min_t(size_t, count / sizeof(ev[0]), ARRAY_SIZE(ev));
+    bool dead;
+    u32 got;
+    int ret;
+
+    if (!n)
+        return -EINVAL;
+
+    for (;;) {
+        spin_lock(&hub->lock);
+        got = ili9488_damage_take(reader, ev, n);
+        dead = hub->dead;
+        spin_unlock(&hub->lock);
+        if (got)
+            break;
+        if (dead)
+            return 0;
+
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(hub->wait, ili9488_damage_ready(reader));
+        if (ret)
+            return ret;
+    }
+
+    if (copy_to_user(buf, ev, got * sizeof(ev[0])))
+        return -EFAULT;
+
+    return got * sizeof(ev[0]);
 }
 
+static __poll_t ili9488_damage_poll(struct file *file, poll_table *wait)
+{
+    struct ili9488_damage_reader *reader = file->private_data;
+    struct ili9488_damage_hub *hub = reader->hub;
+    __poll_t mask = 0;
+
+    poll_wait(file, &hub->wait, wait);
+
+    spin_lock(&hub->lock);
+    if (reader->overflow || !kfifo_is_empty(&reader->fifo))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (hub->dead)
+        mask |= EPOLLHUP;
+    spin_unlock(&hub->lock);
+
+    return mask;
+}
+
+static const struct file_operations ili9488_damage_fops = {
+    .owner      = THIS_MODULE,
+    .open       = ili9488_damage_open,
+    .release    = ili9488_damage_release,
+    .read       = ili9488_damage_read,
+    .poll       = ili9488_damage_poll,
+    .llseek     = no_llseek,
+};
+
 static void ili9488_mkdirty(struct fb_info *info, int y, int height)
 {
     struct ili9488_par *par = info->par;
@@ -815,26 +2149,84 @@ static void ili9488_mkdirty(struct fb_info *info, int y, int height)
         par->dirty_lines_end = y + height - 1;
     spin_unlock(&par->dirty_lock);
 
-    schedule_delayed_work(&info->deferred_work, fbdefio->delay);
+    ili9488_queue_flush(par, fbdefio->delay);
+}
+
+/*
+ * Cursor blinks bypass the deferred flush: the cell is queued for an
+ * immediate push on the flush thread instead of dirtying whole lines.
+ */
+static void ili9488_cursor_push(struct ili9488_par *par, u32 x, u32 y,
+                                u32 width, u32 height)
+{
+    struct ili9488_rect *r;
+    bool queued = false;
+
+    if (!width || !height)
+        return;
+
+    spin_lock(&par->dirty_lock);
+    if (!par->blanked && par->cursor.npending < ILI9488_CURSOR_RECTS) {
+        r = &par->cursor.pending[par->cursor.npending++];
+        r->xs = x;
+        r->ys = y;
+        r->xe = x + width - 1;
+        r->ye = y + height - 1;
+        queued = true;
+    }
+    spin_unlock(&par->dirty_lock);
+
+    if (queued)
+        kthread_queue_work(par->flush_worker, &par->cursor.work);
+    else
+        ili9488_mkdirty(par->fbinfo, y, height);
+}
+
+/* same result as soft_cursor(), but rendered straight into vmem */
+static int ili9488_fb_cursor(struct fb_info *info, struct fb_cursor *cursor)
+{
+    struct ili9488_par *par = info->par;
+    u8 data[ILI9488_CURSOR_MAX * ILI9488_CURSOR_MAX / BITS_PER_BYTE];
+    struct fb_image image = cursor->image;
+    u32 i, size;
+
+    if (info->state != FBINFO_STATE_RUNNING)
+        return 0;
+
+    if (!image.data || !cursor->mask || image.depth != 1 ||
+        image.width > ILI9488_CURSOR_MAX || image.height > ILI9488_CURSOR_MAX)
+        return -EINVAL;
+
+    size = DIV_ROUND_UP(image.width, BITS_PER_BYTE) * image.height;
+    for (i = 0; i < size; i++) {
+        if (!cursor->enable)
+            data[i] = image.data[i];
+        else if (cursor->rop == ROP_XOR)
+            data[i] = image.data[i] ^ cursor->mask[i];
+        else
+            data[i] = image.data[i] & cursor->mask[i];
+    }
+
+    image.data = data;
+    sys_imageblit(info, &image);
+    ili9488_cursor_push(par, image.dx, image.dy, image.width, image.height);
+
+    return 0;
 }
 
+/*
+ * Called by the fbdev core once the mmap write delay has elapsed. Only fold
+ * the touched pages into the dirty range here, the pixels are pushed from
+ * the flush thread.
+ */
 static void ili9488_deferred_io(struct fb_info *info, struct list_head *pagelist)
 {
     struct ili9488_par *par = info->par;
-    unsigned int dirty_lines_start, dirty_lines_end;
+    unsigned int dirty_lines_start = info->var.yres - 1, dirty_lines_end = 0;
     struct fb_deferred_io_pageref *pageref;
     unsigned int y_low = 0, y_high = 0;
     int count = 0;
 
-    spin_lock(&par->dirty_lock);
-    dirty_lines_start = par->dirty_lines_start;
-    dirty_lines_end = par->dirty_lines_end;
-
-    /* clean dirty markers */
-    par->dirty_lines_start = par->fbinfo->var.yres - 1;
-    par->dirty_lines_end = 0;
-    spin_unlock(&par->dirty_lock);
-
     list_for_each_entry(pageref, pagelist, list) {
         count++;
         y_low = pageref->offset / info->fix.line_length;
@@ -854,7 +2246,17 @@ static void ili9488_deferred_io(struct fb_info *info, struct list_head *pagelist
     dev_dbg(info->device,
             "%s, count %d dirty_line  start : %d, end : %d\n",
             __func__, count, dirty_lines_start, dirty_lines_end);
-    update_display(par, dirty_lines_start, dirty_lines_end);
+
+    spin_lock(&par->dirty_lock);
+    if (dirty_lines_start < par->dirty_lines_start)
+        par->dirty_lines_start = dirty_lines_start;
+    if (dirty_lines_end > par->dirty_lines_end)
+        par->dirty_lines_end = dirty_lines_end;
+    if (count)
+        ili9488_frame_account(par, dirty_lines_start, dirty_lines_end);
+    spin_unlock(&par->dirty_lock);
+
+    ili9488_queue_flush(par, 0);
 }
 
 static void ili9488_fb_fillrect(struct fb_info *info,
@@ -864,43 +2266,544 @@ static void ili9488_fb_fillrect(struct fb_info *info,
             "%s: dx=%d, dy=%d, width=%d, height=%d\n",
             __func__, rect->dx, rect->dy, rect->width, rect->height);
 
-    sys_fillrect(info, rect);
-    ili9488_mkdirty(info, rect->dy, rect->height);
+    sys_fillrect(info, rect);
+    ili9488_mkdirty(info, rect->dy, rect->height);
+}
+
+static void ili9488_fb_copyarea(struct fb_info *info,
+                                const struct fb_copyarea *area)
+{
+    dev_dbg(info->dev,
+            "%s: dx=%d, dy=%d, width=%d, height=%d\n",
+            __func__,  area->dx, area->dy, area->width, area->height);
+
+    sys_copyarea(info, area);
+    ili9488_mkdirty(info, area->dy, area->height);
+}
+
+static void ili9488_fb_imageblit(struct fb_info *info,
+                                 const struct fb_image *image)
+{
+    dev_dbg(info->dev,
+            "%s: dx=%d, dy=%d, width=%d, height=%d\n",
+            __func__,  image->dx, image->dy, image->width, image->height);
+    sys_imageblit(info, image);
+
+    ili9488_mkdirty(info, image->dy, image->height);
+}
+
+#ifdef CONFIG_FB_TILEBLITTING
+static void ili9488_tile_mkdirty(struct ili9488_par *par, u32 sx, u32 sy,
+                                 u32 width, u32 height)
+{
+    struct ili9488_tile *tile = &par->tile;
+    u32 r;
+
+    spin_lock(&par->dirty_lock);
+    if (sx < tile->cols) {
+        width = min(width, tile->cols - sx);
+        for (r = sy; r < sy + height && r < tile->rows; r++)
+            bitmap_set(tile->dirty, r * tile->cols + sx, width);
+    }
+    spin_unlock(&par->dirty_lock);
+
+    ili9488_queue_flush(par, par->fbinfo->fbdefio->delay);
+}
+
+/* look up a glyph in the cache, rendering it for this colour pair if needed */
+static const u16 *ili9488_tile_glyph(struct ili9488_par *par, u32 index,
+                                     u32 fg, u32 bg)
+{
+    struct ili9488_tile *tile = &par->tile;
+    const u32 *palette = par->fbinfo->pseudo_palette;
+    const u32 size = tile->width * tile->height;
+    struct ili9488_glyph_slot *slot = NULL, *lru = &tile->slot[0];
+    u16 fgc = palette[fg & 0xf], bgc = palette[bg & 0xf];
+    const u8 *src;
+    u16 *px;
+    u32 x, y;
+    int i;
+
+    for (i = 0; i < ILI9488_TILE_SLOTS; i++) {
+        if (tile->slot[i].fg == fgc && tile->slot[i].bg == bgc) {
+            slot = &tile->slot[i];
+            break;
+        }
+        if (tile->slot[i].last_use < lru->last_use)
+            lru = &tile->slot[i];
+    }
+
+    if (!slot) {
+        slot = lru;
+        slot->fg = fgc;
+        slot->bg = bgc;
+        bitmap_zero(slot->valid, tile->length);
+    }
+    slot->last_use = ++tile->tick;
+
+    index %= tile->length;
+    px = slot->pixels + index * size;
+    if (!test_bit(index, slot->valid)) {
+        src = tile->font + index * tile->pitch * tile->height;
+        for (y = 0; y < tile->height; y++, src += tile->pitch)
+            for (x = 0; x < tile->width; x++)
+                px[y * tile->width + x] =
+                    (src[x / 8] & (0x80 >> (x % 8))) ? fgc : bgc;
+        __set_bit(index, slot->valid);
+    }
+
+    return px;
+}
+
+/* write one character cell to vmem, one memcpy per pixel row */
+static void ili9488_tile_put(struct ili9488_par *par, u32 col, u32 row,
+                             u32 index, u32 fg, u32 bg)
+{
+    struct ili9488_tile *tile = &par->tile;
+    struct fb_info *info = par->fbinfo;
+    struct ili9488_tile_cell *cell = &tile->cells[row * tile->cols + col];
+    const u16 *glyph = ili9488_tile_glyph(par, index, fg, bg);
+    u8 *dst = (u8 *)info->screen_buffer + row * tile->height * info->fix.line_length +
+              col * tile->width * sizeof(u16);
+    u32 y;
+
+    cell->index = index;
+    cell->fg = fg;
+    cell->bg = bg;
+
+    for (y = 0; y < tile->height; y++) {
+        memcpy(dst, glyph, tile->width * sizeof(u16));
+        glyph += tile->width;
+        dst += info->fix.line_length;
+    }
+}
+
+static void ili9488_tile_free(struct ili9488_tile *tile)
+{
+    int i;
+
+    tile->length = 0;
+    for (i = 0; i < ILI9488_TILE_SLOTS; i++) {
+        kvfree(tile->slot[i].pixels);
+        bitmap_free(tile->slot[i].valid);
+        memset(&tile->slot[i], 0, sizeof(tile->slot[i]));
+    }
+    kfree(tile->font);
+    tile->font = NULL;
+}
+
+static void ili9488_fb_settile(struct fb_info *info, struct fb_tilemap *map)
+{
+    struct ili9488_par *par = info->par;
+    struct ili9488_tile *tile = &par->tile;
+    u32 pitch = DIV_ROUND_UP(map->width, 8);
+    int i;
+
+    ili9488_tile_free(tile);
+
+    if (map->depth != 1 || !map->length ||
+        map->width < ILI9488_TILE_MIN || map->height < ILI9488_TILE_MIN) {
+        dev_err(par->dev, "unsupported tile map %ux%u depth %u\n",
+                map->width, map->height, map->depth);
+        return;
+    }
+
+    tile->font = kmemdup(map->data, pitch * map->height * map->length, GFP_KERNEL);
+    if (!tile->font)
+        goto nomem;
+
+    for (i = 0; i < ILI9488_TILE_SLOTS; i++) {
+        tile->slot[i].pixels = kvcalloc(map->length * map->width * map->height,
+                                        sizeof(u16), GFP_KERNEL);
+        tile->slot[i].valid = bitmap_zalloc(map->length, GFP_KERNEL);
+        if (!tile->slot[i].pixels || !tile->slot[i].valid)
+            goto nomem;
+    }
+
+    tile->pitch = pitch;
+    tile->length = map->length;
+    memset(tile->cells, 0, tile->max_cells * sizeof(*tile->cells));
+
+    spin_lock(&par->dirty_lock);
+    tile->width = map->width;
+    tile->height = map->height;
+    tile->cols = info->var.xres / map->width;
+    tile->rows = info->var.yres / map->height;
+    bitmap_zero(tile->dirty, tile->max_cells);
+    spin_unlock(&par->dirty_lock);
+    return;
+
+nomem:
+    ili9488_tile_free(tile);
+    dev_err(par->dev, "failed to allocate glyph cache\n");
+}
+
+static void ili9488_fb_tilecopy(struct fb_info *info, struct fb_tilearea *area)
+{
+    struct ili9488_par *par = info->par;
+    struct ili9488_tile *tile = &par->tile;
+    const u32 line_length = info->fix.line_length;
+    const size_t len = area->width * tile->width * sizeof(u16);
+    const u32 height = area->height * tile->height;
+    const bool up = area->dy > area->sy;
+    u8 *src, *dst;
+    u32 i, y;
+
+    if (!tile->length ||
+        area->sx + area->width > tile->cols || area->dx + area->width > tile->cols ||
+        area->sy + area->height > tile->rows || area->dy + area->height > tile->rows)
+        return;
+
+    src = (u8 *)info->screen_buffer + area->sy * tile->height * line_length +
+          area->sx * tile->width * sizeof(u16);
+    dst = (u8 *)info->screen_buffer + area->dy * tile->height * line_length +
+          area->dx * tile->width * sizeof(u16);
+
+    /* walk bottom-up when moving down so overlapping rows survive */
+    for (i = 0; i < height; i++) {
+        y = up ? height - 1 - i : i;
+        memmove(dst + y * line_length, src + y * line_length, len);
+    }
+
+    for (i = 0; i < area->height; i++) {
+        y = up ? area->height - 1 - i : i;
+        memmove(&tile->cells[(area->dy + y) * tile->cols + area->dx],
+                &tile->cells[(area->sy + y) * tile->cols + area->sx],
+                area->width * sizeof(*tile->cells));
+    }
+
+    ili9488_tile_mkdirty(par, area->dx, area->dy, area->width, area->height);
+}
+
+static void ili9488_fb_tilefill(struct fb_info *info, struct fb_tilerect *rect)
+{
+    struct ili9488_par *par = info->par;
+    struct ili9488_tile *tile = &par->tile;
+    u32 col, row;
+
+    if (!tile->length)
+        return;
+
+    for (row = rect->sy; row < rect->sy + rect->height && row < tile->rows; row++)
+        for (col = rect->sx; col < rect->sx + rect->width && col < tile->cols; col++)
+            ili9488_tile_put(par, col, row, rect->index, rect->fg, rect->bg);
+
+    ili9488_tile_mkdirty(par, rect->sx, rect->sy, rect->width, rect->height);
+}
+
+static void ili9488_fb_tileblit(struct fb_info *info, struct fb_tileblit *blit)
+{
+    struct ili9488_par *par = info->par;
+    struct ili9488_tile *tile = &par->tile;
+    u32 i, col, row;
+
+    if (!tile->length || !blit->width)
+        return;
+
+    for (i = 0; i < blit->length; i++) {
+        col = blit->sx + i % blit->width;
+        row = blit->sy + i / blit->width;
+        if (row >= blit->sy + blit->height)
+            break;
+        if (col >= tile->cols || row >= tile->rows)
+            continue;
+        ili9488_tile_put(par, col, row, blit->indices[i], blit->fg, blit->bg);
+    }
+
+    ili9488_tile_mkdirty(par, blit->sx, blit->sy, blit->width, blit->height);
+}
+
+/* cursor heights as used by fbcon's bitblit cursor */
+static u32 ili9488_tile_cursor_height(u32 height, u32 shape)
+{
+    switch (shape) {
+    case FB_TILE_CURSOR_UNDERLINE:
+        return height < 10 ? 1 : 2;
+    case FB_TILE_CURSOR_LOWER_THIRD:
+        return height / 3;
+    case FB_TILE_CURSOR_LOWER_HALF:
+        return height / 2;
+    case FB_TILE_CURSOR_TWO_THIRDS:
+        return (height << 1) / 3;
+    case FB_TILE_CURSOR_BLOCK:
+        return height;
+    default:
+        return 0;
+    }
+}
+
+static void ili9488_fb_tilecursor(struct fb_info *info, struct fb_tilecursor *cursor)
+{
+    struct ili9488_par *par = info->par;
+    struct ili9488_tile *tile = &par->tile;
+    const u32 *palette = info->pseudo_palette;
+    struct ili9488_tile_cell *cell;
+    u32 x, y, h;
+    u16 *px;
+    u16 xor;
+
+    if (!tile->length || cursor->sx >= tile->cols || cursor->sy >= tile->rows)
+        return;
+
+    /* redrawing the cell from the grid also erases an earlier cursor */
+    cell = &tile->cells[cursor->sy * tile->cols + cursor->sx];
+    ili9488_tile_put(par, cursor->sx, cursor->sy, cell->index, cell->fg, cell->bg);
+
+    h = cursor->mode ? ili9488_tile_cursor_height(tile->height, cursor->shape) : 0;
+    xor = palette[cell->fg & 0xf] ^ palette[cell->bg & 0xf];
+    if (!xor)
+        xor = 0xFFFF;
+
+    for (y = tile->height - h; y < tile->height; y++) {
+        px = (u16 *)(info->screen_buffer +
+                     (cursor->sy * tile->height + y) * info->fix.line_length +
+                     cursor->sx * tile->width * sizeof(u16));
+        for (x = 0; x < tile->width; x++)
+            px[x] ^= xor;
+    }
+
+    ili9488_cursor_push(par, cursor->sx * tile->width, cursor->sy * tile->height,
+                        tile->width, tile->height);
+}
+
+static int ili9488_fb_get_tilemax(struct fb_info *info)
+{
+    return 512;
+}
+
+static struct fb_tile_ops ili9488_tile_ops = {
+    .fb_settile     = ili9488_fb_settile,
+    .fb_tilecopy    = ili9488_fb_tilecopy,
+    .fb_tilefill    = ili9488_fb_tilefill,
+    .fb_tileblit    = ili9488_fb_tileblit,
+    .fb_tilecursor  = ili9488_fb_tilecursor,
+    .fb_get_tilemax = ili9488_fb_get_tilemax,
+};
+
+/* the cell grid is sized for the smallest font fbcon may pick */
+static int ili9488_tile_init(struct ili9488_par *par)
+{
+    struct fb_info *info = par->fbinfo;
+    struct ili9488_tile *tile = &par->tile;
+    struct device *dev = par->dev;
+    u32 max_rows = info->var.yres / ILI9488_TILE_MIN;
+
+    tile->max_cells = (info->var.xres / ILI9488_TILE_MIN) * max_rows;
+    tile->cells = devm_kcalloc(dev, tile->max_cells, sizeof(*tile->cells), GFP_KERNEL);
+    tile->dirty = devm_bitmap_zalloc(dev, tile->max_cells, GFP_KERNEL);
+    tile->row_first = devm_kcalloc(dev, max_rows, sizeof(u16), GFP_KERNEL);
+    tile->row_last = devm_kcalloc(dev, max_rows, sizeof(u16), GFP_KERNEL);
+    if (!tile->cells || !tile->dirty || !tile->row_first || !tile->row_last)
+        return -ENOMEM;
+
+    info->tileops = &ili9488_tile_ops;
+    info->flags |= FBINFO_MISC_TILEBLITTING;
+    info->pixmap.blit_x = GENMASK(31, ILI9488_TILE_MIN - 1);
+    info->pixmap.blit_y = GENMASK(31, ILI9488_TILE_MIN - 1);
+
+    return 0;
+}
+#else
+static inline int ili9488_tile_init(struct ili9488_par *par) { return 0; }
+static inline void ili9488_tile_free(struct ili9488_tile *tile) { }
+#endif
+
+/* only the lines covered by the bytes actually written are dirty */
+static ssize_t ili9488_fb_write(struct fb_info *info, const char __user *buf,
+                                size_t count, loff_t *ppos)
+{
+    struct ili9488_par *par = info->par;
+    const u32 line_length = info->fix.line_length;
+    loff_t pos = *ppos;
+    ssize_t res;
+    u32 first, last;
+
+    dev_dbg(info->dev,
+            "%s: count=%zd, ppos=%llu\n", __func__,  count, *ppos);
+
+    res = fb_sys_write(info, buf, count, ppos);
+    if (res <= 0)
+        return res;
+
+    first = div_u64(pos, line_length);
+    last = div_u64(pos + res - 1, line_length);
+
+    spin_lock(&par->dirty_lock);
+    ili9488_frame_account(par, first, last);
+    spin_unlock(&par->dirty_lock);
+    ili9488_mkdirty(info, first, last - first + 1);
+
+    return res;
+}
+
+/* BT.601 limited range, 8 bit fixed point */
+static inline u16 yuv_to_rgb565(int y, int u, int v)
+{
+    int c = 298 * (y - 16) + 128, d = u - 128, e = v - 128;
+    int r = clamp((c + 409 * e) >> 8, 0, 255);
+    int g = clamp((c - 100 * d - 208 * e) >> 8, 0, 255);
+    int b = clamp((c + 516 * d) >> 8, 0, 255);
+
+    return (r & 0xF8) << 8 | (g & 0xFC) << 3 | b >> 3;
+}
+
+/* row scratch and the two transmit buffers, allocated on first use */
+static int ili9488_video_alloc(struct ili9488_par *par)
+{
+    struct fb_info *info = par->fbinfo;
+    const size_t len = info->var.xres * info->var.yres * 2;
+    struct device *dev = par->dev;
+
+    if (par->video.in)
+        return 0;
+
+    par->video.buf[0] = devm_kmalloc(dev, len, GFP_KERNEL);
+    par->video.buf[1] = devm_kmalloc(dev, len, GFP_KERNEL);
+    par->video.row = devm_kcalloc(dev, info->var.xres, sizeof(u16), GFP_KERNEL);
+    par->video.in = devm_kmalloc(dev, info->var.xres * 2 * 4, GFP_KERNEL);
+    if (!par->video.buf[0] || !par->video.buf[1] || !par->video.row || !par->video.in) {
+        par->video.in = NULL;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+ * Build one RGB565 output row. The source rows needed for it (one or two
+ * luma rows and the matching chroma row) are copied from userspace into
+ * the scratch buffer first.
+ */
+static int ili9488_yuv_row(struct ili9488_par *par, const struct ili9488_yuv_frame *f,
+                           u32 oy, u32 out_w)
+{
+    const bool down = f->scale != ILI9488_YUV_SCALE_NONE;
+    const u32 sy = down ? oy * 2 : oy;
+    const u32 cy = down ? oy : oy / 2;
+    const u32 cw = f->format == ILI9488_YUV_NV12 ? f->width : f->width / 2;
+    u8 *y0 = par->video.in, *y1 = y0 + f->width;
+    u8 *cu = y1 + f->width, *cv = cu + cw;
+    u16 *row = par->video.row;
+    int yv, u, v;
+    u32 ox, sx, cx;
+
+    if (copy_from_user(y0, u64_to_user_ptr(f->y + (u64)sy * f->y_stride), f->width) ||
+        copy_from_user(cu, u64_to_user_ptr(f->u + (u64)cy * f->uv_stride), cw))
+        return -EFAULT;
+    if (f->scale == ILI9488_YUV_SCALE_BILINEAR &&
+        copy_from_user(y1, u64_to_user_ptr(f->y + (u64)(sy + 1) * f->y_stride), f->width))
+        return -EFAULT;
+    if (f->format == ILI9488_YUV_I420 &&
+        copy_from_user(cv, u64_to_user_ptr(f->v + (u64)cy * f->uv_stride), cw))
+        return -EFAULT;
+
+    for (ox = 0; ox < out_w; ox++) {
+        sx = down ? ox * 2 : ox;
+        cx = down ? ox : ox / 2;
+
+        if (f->scale == ILI9488_YUV_SCALE_BILINEAR)
+            yv = (y0[sx] + y0[sx + 1] + y1[sx] + y1[sx + 1] + 2) >> 2;
+        else
+            yv = y0[sx];
+
+        if (f->format == ILI9488_YUV_NV12) {
+            u = cu[cx * 2];
+            v = cu[cx * 2 + 1];
+        } else {
+            u = cu[cx];
+            v = cv[cx];
+        }
+
+        row[ox] = yuv_to_rgb565(yv, u, v);
+    }
+
+    return 0;
 }
 
-static void ili9488_fb_copyarea(struct fb_info *info,
-                                const struct fb_copyarea *area)
+/*
+ * Convert the frame into the idle transmit buffer, then wait for the
+ * frame before it to go out and hand this one to the flush thread. The
+ * conversion of one frame overlaps the transfer of the previous one.
+ */
+static int ili9488_yuv_frame(struct ili9488_par *par, const struct ili9488_yuv_frame *f)
 {
-    dev_dbg(info->dev,
-            "%s: dx=%d, dy=%d, width=%d, height=%d\n",
-            __func__,  area->dx, area->dy, area->width, area->height);
+    struct fb_info *info = par->fbinfo;
+    const bool down = f->scale != ILI9488_YUV_SCALE_NONE;
+    const u32 out_w = down ? f->width / 2 : f->width;
+    const u32 out_h = down ? f->height / 2 : f->height;
+    ili9488_conv_fn conv;
+    bool three_bit;
+    size_t row_bytes, k = 0;
+    u8 *buf;
+    u32 oy;
+    int ret;
 
-    sys_copyarea(info, area);
-    ili9488_mkdirty(info, area->dy, area->height);
-}
+    if ((f->format != ILI9488_YUV_I420 && f->format != ILI9488_YUV_NV12) ||
+        f->scale > ILI9488_YUV_SCALE_BILINEAR ||
+        !out_w || !out_h || f->width % 2 || f->height % 2 ||
+        f->y_stride < f->width ||
+        f->uv_stride < (f->format == ILI9488_YUV_NV12 ? f->width : f->width / 2) ||
+        out_w > info->var.xres || out_h > info->var.yres ||
+        f->dst_x > info->var.xres - out_w || f->dst_y > info->var.yres - out_h)
+        return -EINVAL;
+
+    mutex_lock(&par->video.lock);
+    ret = ili9488_video_alloc(par);
+    if (ret)
+        goto out;
+
+    mutex_lock(&par->io_lock);
+    three_bit = par->mode.three_bit;
+    conv = ili9488_conv_select_bpp(par, 16, out_w, &row_bytes);
+    mutex_unlock(&par->io_lock);
+
+    /* two pixels share a byte in 3 bit mode */
+    if (three_bit && (f->dst_x % 2 || out_w % 2)) {
+        ret = -EINVAL;
+        goto out;
+    }
 
-static void ili9488_fb_imageblit(struct fb_info *info,
-                                 const struct fb_image *image)
-{
-    dev_dbg(info->dev,
-            "%s: dx=%d, dy=%d, width=%d, height=%d\n",
-            __func__,  image->dx, image->dy, image->width, image->height);
-    sys_imageblit(info, image);
+    buf = par->video.buf[par->video.next];
+    for (oy = 0; oy < out_h; oy++) {
+        ret = ili9488_yuv_row(par, f, oy, out_w);
+        if (ret)
+            goto out;
+        k += conv(par, buf + k, par->video.row, f->dst_x, f->dst_y + oy, out_w);
+    }
 
-    ili9488_mkdirty(info, image->dy, image->height);
+    ret = wait_for_completion_interruptible(&par->complete);
+    if (ret)
+        goto out;
+    reinit_completion(&par->complete);
+
+    par->video.pending = buf;
+    par->video.rect.xs = f->dst_x;
+    par->video.rect.ys = f->dst_y;
+    par->video.rect.xe = f->dst_x + out_w - 1;
+    par->video.rect.ye = f->dst_y + out_h - 1;
+    par->video.row_bytes = row_bytes;
+    par->video.three_bit = three_bit;
+    par->video.next ^= 1;
+    kthread_queue_work(par->flush_worker, &par->video.work);
+
+out:
+    mutex_unlock(&par->video.lock);
+    return ret;
 }
 
-static ssize_t ili9488_fb_write(struct fb_info *info, const char __user *buf,
-                                size_t count, loff_t *ppos)
+static int ili9488_fb_ioctl(struct fb_info *info, unsigned int cmd,
+                            unsigned long arg)
 {
-    ssize_t res;
-    dev_dbg(info->dev,
-            "%s: count=%zd, ppos=%llu\n", __func__,  count, *ppos);
-
-    res = fb_sys_write(info, buf, count, ppos);
+    struct ili9488_yuv_frame frame;
 
-    ili9488_mkdirty(info, -1, 0);
-    return 0;
+    switch (cmd) {
+    case ILI9488_IOC_YUV_FRAME:
+        if (copy_from_user(&frame, (void __user *)arg, sizeof(frame)))
+            return -EFAULT;
+        return ili9488_yuv_frame(info->par, &frame);
+    default:
+        return -ENOTTY;
+    }
 }
 
 /* from pxafb.c */
@@ -928,6 +2831,19 @@ static int ili9488_fb_setcolreg(unsigned int regno, unsigned int red,
     */
 
     switch (info->fix.visual) {
+    case FB_VISUAL_PSEUDOCOLOR: {
+        struct ili9488_par *par = info->par;
+        u16 c = (red & 0xF800) | ((green >> 5) & 0x07E0) | (blue >> 11);
+
+        /* a palette change only costs a re-flush, vmem is untouched */
+        if (par->palette_raw[regno] != c) {
+            par->palette_raw[regno] = c;
+            ili9488_palette_expand(par, regno);
+            ili9488_mkdirty(info, -1, 0);
+        }
+        ret = 0;
+        break;
+    }
     case FB_VISUAL_TRUECOLOR:
         if (regno < 16) {
             val  = chan_to_field(red, &info->var.red);
@@ -951,43 +2867,481 @@ static int ili9488_fb_setcolreg(unsigned int regno, unsigned int red,
     return ret;
 }
 
+static u32 ili9488_mode_to_nonstd(const struct ili9488_mode *mode)
+{
+    u32 nonstd = mode->fps;
+
+    if (mode->three_bit)
+        nonstd |= ILI9488_NONSTD_3BIT;
+    if (mode->dither)
+        nonstd |= ILI9488_NONSTD_DITHER;
+
+    return nonstd;
+}
+
+/*
+ * Switch wire format, dithering and frame rate. A flush holds io_lock for
+ * the whole frame, so the switch lands between two frames, after which
+ * the screen is sent again in the new format. Called with the fb_info
+ * lock held.
+ */
+static int ili9488_update_mode(struct ili9488_par *par,
+                               const struct ili9488_mode *mode)
+{
+    struct fb_info *info = par->fbinfo;
+    int rc;
+
+    if (mode->three_bit == par->mode.three_bit &&
+        mode->dither == par->mode.dither && mode->fps == par->mode.fps)
+        return 0;
+
+    dev_dbg(par->dev, "%s, 3bit %d, dither %d, fps %u\n", __func__,
+            mode->three_bit, mode->dither, mode->fps);
+
+    rc = pm_runtime_resume_and_get(par->dev);
+    if (rc < 0)
+        return rc;
+    mutex_lock(&par->io_lock);
+    ili9488_pm_wake_wait(par);
+    if (mode->three_bit != par->mode.three_bit) {
+        gpio_put(par->gpio.cs, 0);
+        write_reg(par, MIPI_DCS_SET_PIXEL_FORMAT, mode->three_bit ? 0x22 : 0x55);
+        gpio_put(par->gpio.cs, 1);
+    }
+    par->mode = *mode;
+    info->fbdefio->delay = HZ / mode->fps;
+    mutex_unlock(&par->io_lock);
+    pm_runtime_mark_last_busy(par->dev);
+    pm_runtime_put_autosuspend(par->dev);
+
+    info->var.nonstd = ili9488_mode_to_nonstd(mode);
+    ili9488_mkdirty(info, -1, 0);
+
+    return 0;
+}
+
+/* only the wire format in nonstd can change, the geometry is fixed */
+static int ili9488_fb_check_var(struct fb_var_screeninfo *var,
+                                struct fb_info *info)
+{
+    u32 nonstd = var->nonstd;
+
+    if (var->xres != info->var.xres || var->yres != info->var.yres ||
+        var->bits_per_pixel != info->var.bits_per_pixel)
+        return -EINVAL;
+
+    if ((nonstd & ILI9488_NONSTD_FPS) > ILI9488_FPS_MAX)
+        return -EINVAL;
+
+    nonstd &= ILI9488_NONSTD_FPS | ILI9488_NONSTD_3BIT | ILI9488_NONSTD_DITHER;
+    if (!(nonstd & ILI9488_NONSTD_3BIT))
+        nonstd &= ~ILI9488_NONSTD_DITHER;
+
+    var->xres_virtual = info->var.xres_virtual;
+    var->yres_virtual = info->var.yres_virtual;
+    var->xoffset = 0;
+    var->yoffset = 0;
+    var->rotate = info->var.rotate;
+    var->grayscale = 0;
+    var->red = info->var.red;
+    var->green = info->var.green;
+    var->blue = info->var.blue;
+    var->transp = info->var.transp;
+    var->nonstd = nonstd;
+
+    return 0;
+}
+
+static int ili9488_fb_set_par(struct fb_info *info)
+{
+    struct ili9488_par *par = info->par;
+    u32 nonstd = info->var.nonstd;
+    struct ili9488_mode mode;
+
+    mode.three_bit = !!(nonstd & ILI9488_NONSTD_3BIT);
+    mode.dither = !!(nonstd & ILI9488_NONSTD_DITHER);
+    mode.fps = nonstd & ILI9488_NONSTD_FPS;
+    if (!mode.fps)
+        mode.fps = par->mode.fps;
+
+    info->var.nonstd = ili9488_mode_to_nonstd(&mode);
+
+    return ili9488_update_mode(par, &mode);
+}
+
+/*
+ * While blanked nothing is sent to the panel and it is put to sleep
+ * through runtime PM, whatever p_pm_mode says. Damage keeps accumulating
+ * and is flushed as a single update once the display is unblanked.
+ */
 static int ili9488_fb_blank(int blank, struct fb_info *info)
 {
     struct ili9488_par *par = info->par;
+    bool was_blanked;
     int ret = -EINVAL;
 
+    spin_lock(&par->dirty_lock);
+    was_blanked = par->blanked;
+    spin_unlock(&par->dirty_lock);
+
     switch (blank) {
     case FB_BLANK_POWERDOWN:
     case FB_BLANK_VSYNC_SUSPEND:
     case FB_BLANK_HSYNC_SUSPEND:
     case FB_BLANK_NORMAL:
-        ret = ili9488_blank(par, true);
+        if (was_blanked)
+            return 0;
+
+        ret = pm_runtime_resume_and_get(par->dev);
+        if (ret < 0)
+            return ret;
+
+        spin_lock(&par->dirty_lock);
+        par->blanked = true;
+        spin_unlock(&par->dirty_lock);
+
+        mutex_lock(&par->io_lock);
+        ili9488_pm_wake_wait(par);
+        ret = par->tftops->blank(par, true);
+        mutex_unlock(&par->io_lock);
+
+        if (par->pm.hold) {
+            par->pm.hold = false;
+            pm_runtime_put_noidle(par->dev);
+        }
+        pm_runtime_put_sync_suspend(par->dev);
         break;
     case FB_BLANK_UNBLANK:
-        ret = ili9488_blank(par, false);
+        if (!was_blanked)
+            return 0;
+
+        ret = pm_runtime_resume_and_get(par->dev);
+        if (ret < 0)
+            return ret;
+        mutex_lock(&par->io_lock);
+        ili9488_pm_wake_wait(par);
+        ret = par->tftops->blank(par, false);
+        mutex_unlock(&par->io_lock);
+
+        spin_lock(&par->dirty_lock);
+        par->blanked = false;
+        spin_unlock(&par->dirty_lock);
+
+        if (!p_pm_mode) {
+            par->pm.hold = true;
+            pm_runtime_get_noresume(par->dev);
+        }
+        pm_runtime_mark_last_busy(par->dev);
+        pm_runtime_put_autosuspend(par->dev);
+        ili9488_queue_flush(par, 0);
         break;
     }
     return ret;
 }
 
-static const struct ili9488_display display = {
-    .xres = 320,
-    .yres = 320,
-    .bpp = 16,
-    .fps = 30,
+/*
+ * Partial Mode: only rows <first> <last> are driven by the panel and only
+ * damage inside them is sent, the rest of vmem is ignored. "off" returns
+ * to Normal Mode and repaints the whole screen.
+ */
+static ssize_t partial_show(struct device *dev, struct device_attribute *attr,
+                            char *buf)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+    ssize_t ret;
+
+    mutex_lock(&par->io_lock);
+    if (par->partial.on)
+        ret = sysfs_emit(buf, "%u %u\n", par->partial.ys, par->partial.ye);
+    else
+        ret = sysfs_emit(buf, "off\n");
+    mutex_unlock(&par->io_lock);
+
+    return ret;
+}
+
+static ssize_t partial_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+    u32 yres = par->fbinfo->var.yres;
+    u32 ys = 0, ye = yres - 1;
+    bool on = !sysfs_streq(buf, "off");
+    int rc;
+
+    if (on && (sscanf(buf, "%u %u", &ys, &ye) != 2 || ys > ye || ye >= yres))
+        return -EINVAL;
+
+    rc = pm_runtime_resume_and_get(dev);
+    if (rc < 0)
+        return rc;
+    mutex_lock(&par->io_lock);
+    ili9488_pm_wake_wait(par);
+
+    gpio_put(par->gpio.cs, 0);
+    if (on) {
+        u32 off = par->display.ys_off;
+
+        write_reg(par, MIPI_DCS_SET_PARTIAL_ROWS,
+                  (ys + off) >> BITS_PER_BYTE, (ys + off) & 0xFF,
+                  (ye + off) >> BITS_PER_BYTE, (ye + off) & 0xFF);
+        write_reg(par, MIPI_DCS_ENTER_PARTIAL_MODE);
+    } else {
+        write_reg(par, MIPI_DCS_ENTER_NORMAL_MODE);
+    }
+    gpio_put(par->gpio.cs, 1);
+
+    par->partial.on = on;
+    par->partial.ys = ys;
+    par->partial.ye = ye;
+    mutex_unlock(&par->io_lock);
+
+    pm_runtime_mark_last_busy(dev);
+    pm_runtime_put_autosuspend(dev);
+
+    /* rows that were not driven may be stale, repaint what is visible now */
+    ili9488_mkdirty(par->fbinfo, ys, ye - ys + 1);
+
+    return count;
+}
+static DEVICE_ATTR_RW(partial);
+
+/* same switches as the nonstd flags, for scripts and apps without an fb fd */
+static ssize_t wire_format_show(struct device *dev, struct device_attribute *attr,
+                                char *buf)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%s\n", par->mode.three_bit ? "3bit" : "rgb565");
+}
+
+static ssize_t wire_format_store(struct device *dev, struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+    struct ili9488_mode mode;
+    int ret;
+
+    lock_fb_info(par->fbinfo);
+    mode = par->mode;
+    if (sysfs_streq(buf, "3bit")) {
+        mode.three_bit = true;
+    } else if (sysfs_streq(buf, "rgb565")) {
+        mode.three_bit = false;
+        mode.dither = false;
+    } else {
+        unlock_fb_info(par->fbinfo);
+        return -EINVAL;
+    }
+    ret = ili9488_update_mode(par, &mode);
+    unlock_fb_info(par->fbinfo);
+
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(wire_format);
+
+static ssize_t dither_show(struct device *dev, struct device_attribute *attr,
+                           char *buf)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", par->mode.dither);
+}
+
+static ssize_t dither_store(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+    struct ili9488_mode mode;
+    bool dither;
+    int ret;
+
+    ret = kstrtobool(buf, &dither);
+    if (ret)
+        return ret;
+
+    lock_fb_info(par->fbinfo);
+    mode = par->mode;
+    mode.dither = dither && mode.three_bit;
+    ret = ili9488_update_mode(par, &mode);
+    unlock_fb_info(par->fbinfo);
+
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(dither);
+
+static ssize_t fps_show(struct device *dev, struct device_attribute *attr,
+                        char *buf)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", par->mode.fps);
+}
+
+static ssize_t fps_store(struct device *dev, struct device_attribute *attr,
+                         const char *buf, size_t count)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+    struct ili9488_mode mode;
+    u32 fps;
+    int ret;
+
+    ret = kstrtou32(buf, 10, &fps);
+    if (ret)
+        return ret;
+    if (!fps || fps > ILI9488_FPS_MAX)
+        return -EINVAL;
+
+    lock_fb_info(par->fbinfo);
+    mode = par->mode;
+    mode.fps = fps;
+    ret = ili9488_update_mode(par, &mode);
+    unlock_fb_info(par->fbinfo);
+
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(fps);
+
+static const char * const ili9488_filter_names[ILI9488_FILTER_NR] = {
+    [ILI9488_FILTER_NONE]       = "none",
+    [ILI9488_FILTER_GRAYSCALE]  = "grayscale",
+    [ILI9488_FILTER_NIGHT]      = "night",
+    [ILI9488_FILTER_INVERT]     = "invert",
+};
+
+static u16 ili9488_filter_apply(enum ili9488_filter filter, u16 c)
+{
+    switch (filter) {
+    case ILI9488_FILTER_GRAYSCALE:
+        return rgb565_to_grayscale_byweight(c);
+    case ILI9488_FILTER_NIGHT:
+        return rgb565_to_night(c);
+    case ILI9488_FILTER_INVERT:
+        return ~c;
+    default:
+        return c;
+    }
+}
+
+/* colour effect applied while converting, the whole screen is resent at once */
+static ssize_t color_filter_show(struct device *dev, struct device_attribute *attr,
+                                 char *buf)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < ILI9488_FILTER_NR; i++)
+        len += sysfs_emit_at(buf, len, i == par->filter ? "[%s] " : "%s ",
+                             ili9488_filter_names[i]);
+    buf[len - 1] = '\n';
+
+    return len;
+}
+
+static ssize_t color_filter_store(struct device *dev, struct device_attribute *attr,
+                                  const char *buf, size_t count)
+{
+    struct ili9488_par *par = dev_get_drvdata(dev);
+    int filter, i;
+    u32 c;
+
+    filter = sysfs_match_string(ili9488_filter_names, buf);
+    if (filter < 0)
+        return filter;
+
+    mutex_lock(&par->io_lock);
+    if (filter != ILI9488_FILTER_NONE && !par->lut_buf) {
+        par->lut_buf = kvmalloc_array(U16_MAX + 1, sizeof(u16), GFP_KERNEL);
+        if (!par->lut_buf) {
+            mutex_unlock(&par->io_lock);
+            return -ENOMEM;
+        }
+    }
+
+    if (filter == ILI9488_FILTER_NONE) {
+        par->lut = NULL;
+    } else {
+        for (c = 0; c <= U16_MAX; c++)
+            par->lut_buf[c] = ili9488_filter_apply(filter, c);
+        par->lut = par->lut_buf;
+    }
+    par->filter = filter;
+
+    for (i = 0; i < ARRAY_SIZE(par->palette); i++)
+        ili9488_palette_expand(par, i);
+    mutex_unlock(&par->io_lock);
+
+    ili9488_mkdirty(par->fbinfo, -1, 0);
+
+    return count;
+}
+static DEVICE_ATTR_RW(color_filter);
+
+static struct attribute *ili9488_attrs[] = {
+    &dev_attr_partial.attr,
+    &dev_attr_wire_format.attr,
+    &dev_attr_dither.attr,
+    &dev_attr_fps.attr,
+    &dev_attr_color_filter.attr,
+    NULL,
+};
+
+static const struct attribute_group ili9488_attr_group = {
+    .attrs = ili9488_attrs,
+};
+
+/*
+ * frames/: what happened to application frames. merged, dropped and
+ * superseded grow when the app renders faster than the panel takes
+ * frames, a hint to lower its render rate.
+ */
+#define ILI9488_FRAMES_ATTR(_name)                                          \
+static ssize_t _name##_show(struct device *dev,                             \
+                            struct device_attribute *attr, char *buf)       \
+{                                                                           \
+    struct ili9488_par *par = dev_get_drvdata(dev);                         \
+    u64 val;                                                                \
+                                                                            \
+    spin_lock(&par->dirty_lock);                                            \
+    val = par->frames._name;                                                \
+    spin_unlock(&par->dirty_lock);                                          \
+                                                                            \
+    return sysfs_emit(buf, "%llu\n", val);                                  \
+}                                                                           \
+static DEVICE_ATTR_RO(_name)
+
+ILI9488_FRAMES_ATTR(submitted);
+ILI9488_FRAMES_ATTR(flushed);
+ILI9488_FRAMES_ATTR(merged);
+ILI9488_FRAMES_ATTR(dropped);
+ILI9488_FRAMES_ATTR(superseded);
+
+static struct attribute *ili9488_frames_attrs[] = {
+    &dev_attr_submitted.attr,
+    &dev_attr_flushed.attr,
+    &dev_attr_merged.attr,
+    &dev_attr_dropped.attr,
+    &dev_attr_superseded.attr,
+    NULL,
+};
+
+static const struct attribute_group ili9488_frames_group = {
+    .name = "frames",
+    .attrs = ili9488_frames_attrs,
 };
 
-static const struct ili9488_display display_3bit = {
-    .xres = 320,
-    .yres = 320,
-    .bpp = 16,
-    .fps = 60,
+static const struct attribute_group *ili9488_attr_groups[] = {
+    &ili9488_attr_group,
+    &ili9488_frames_group,
+    NULL,
 };
 
 static int ili9488_probe(struct spi_device *spi)
 {
     struct device *dev = &spi->dev;
     struct ili9488_par *par;
+    struct ili9488_display disp;
     struct fb_deferred_io *fbdefio;
     struct fb_event event;
     int width, height, bpp, rotate;
@@ -996,60 +3350,60 @@ static int ili9488_probe(struct spi_device *spi)
     u8 *vmem = NULL;
     int vmem_size;
     int spi_tx_buf_size;
+    char name[64];
     int rc;
 
+    rc = ili9488_of_display(dev, &disp);
+    if (rc)
+        return rc;
+
     /* memory resource alloc */
-    if (p_3bit_mode)
-    {
-        rotate = display_3bit.rotate;
-        bpp = display_3bit.bpp;
-        switch (rotate) {
-        case 90:
-        case 270:
-            width = display_3bit.yres;
-            height = display_3bit.xres;
-            break;
-        default:
-            width = display_3bit.xres;
-            height = display_3bit.yres;
-            break;
-        }
+    rotate = disp.rotate;
+    bpp = disp.bpp;
+    switch (rotate) {
+    case 90:
+    case 270:
+        width = disp.yres;
+        height = disp.xres;
+        break;
+    default:
+        width = disp.xres;
+        height = disp.yres;
+        break;
     }
-    else
-    {
-        rotate = display.rotate;
-        bpp = display.bpp;
-        switch (rotate) {
-        case 90:
-        case 270:
-            width = display.yres;
-            height = display.xres;
-            break;
-        default:
-            width = display.xres;
-            height = display.yres;
-            break;
-        }
+
+    switch (p_bpp) {
+    case 0:
+        break;
+    case 8:
+    case 16:
+    case 32:
+        bpp = p_bpp;
+        break;
+    default:
+        dev_warn(dev, "unsupported p_bpp %d, using %d\n", p_bpp, bpp);
+        break;
     }
 
     vmem_size = (width * height * bpp) / BITS_PER_BYTE;
     vmem = vzalloc(vmem_size);
     if (!vmem)
-        goto alloc_fail;
+        return -ENOMEM;
 
+    rc = -ENOMEM;
     fbops = devm_kzalloc(dev, sizeof(struct fb_ops), GFP_KERNEL);
     if (!fbops)
-        goto alloc_fail;
+        goto err_vmem;
 
     fbdefio = devm_kzalloc(dev, sizeof(struct fb_deferred_io), GFP_KERNEL);
     if (!fbdefio)
-        goto alloc_fail;
+        goto err_vmem;
 
     /* framebuffer info setup */
     info = framebuffer_alloc(sizeof(struct ili9488_par), dev);
     if (!info) {
         dev_err(dev, "failed to alloc framebuffer!\n");
-        return -ENOMEM;
+        goto err_vmem;
     }
 
     info->screen_buffer = vmem;
@@ -1063,7 +3417,11 @@ static int ili9488_probe(struct spi_device *spi)
     fbops->fb_copyarea  = ili9488_fb_copyarea;
     fbops->fb_imageblit = ili9488_fb_imageblit;
     fbops->fb_setcolreg = ili9488_fb_setcolreg;
+    fbops->fb_check_var = ili9488_fb_check_var;
+    fbops->fb_set_par   = ili9488_fb_set_par;
     fbops->fb_blank     = ili9488_fb_blank;
+    fbops->fb_cursor    = ili9488_fb_cursor;
+    fbops->fb_ioctl     = ili9488_fb_ioctl;
     fbops->fb_mmap      = fb_deferred_io_mmap;
 
     snprintf(info->fix.id, sizeof(info->fix.id), "%s", dev->driver->name);
@@ -1083,7 +3441,6 @@ static int ili9488_probe(struct spi_device *spi)
     info->var.yres_virtual    =       info->var.yres;
 
     info->var.bits_per_pixel  =       bpp;
-    info->var.nonstd          =       1;
     info->var.grayscale       =       0;
 
     switch (info->var.bits_per_pixel) {
@@ -1105,22 +3462,29 @@ static int ili9488_probe(struct spi_device *spi)
         info->var.transp.offset   =       0;
         info->var.transp.length   =       0;
         break;
+
+    case 32:
+        info->var.red.offset      =       16;
+        info->var.red.length      =       8;
+        info->var.green.offset    =       8;
+        info->var.green.length    =       8;
+        info->var.blue.offset     =       0;
+        info->var.blue.length     =       8;
+        info->var.transp.offset   =       0;
+        info->var.transp.length   =       0;
+        break;
     default:
         dev_err(dev, "color depth %d not supported\n",
                 info->var.bits_per_pixel);
         break;
     }
 
+    if (bpp == 8)
+        info->fix.visual = FB_VISUAL_PSEUDOCOLOR;
+
     info->flags = FBINFO_FLAG_DEFAULT | FBINFO_VIRTFB;
 
-    if (p_3bit_mode)
-    {
-        fbdefio->delay = HZ / display_3bit.fps;
-    }
-    else
-    {
-        fbdefio->delay = HZ / display.fps;
-    }
+    fbdefio->delay = HZ / disp.fps;
     fbdefio->deferred_io = ili9488_deferred_io;
     fb_deferred_io_init(info);
 
@@ -1136,42 +3500,123 @@ static int ili9488_probe(struct spi_device *spi)
     par->buf = devm_kzalloc(dev, 128, GFP_KERNEL);
     if (!par->buf) {
         dev_err(dev, "failed to alloc buf memory!\n");
-        return -ENOMEM;
+        goto err_defio;
     }
 
     spi_tx_buf_size = width * height * 3;
     par->txbuf.buf = devm_kzalloc(dev, spi_tx_buf_size, GFP_KERNEL);
     if (!par->txbuf.buf) {
          dev_err(dev, "failed to alloc txbuf!\n");
-         return -ENOMEM;
+         goto err_defio;
     }
     par->txbuf.len = spi_tx_buf_size;
 
-    par->tftops = &default_ili9488_ops;
-    if (p_3bit_mode)
-    {
-        par->display = &display_3bit;
-    }
-    else
-    {
-        par->display = &display;
+    par->cursor.buf = devm_kzalloc(dev, ILI9488_CURSOR_BUF, GFP_KERNEL);
+    if (!par->cursor.buf) {
+         dev_err(dev, "failed to alloc cursor buf!\n");
+         goto err_defio;
     }
+    par->cursor.xfer.tx_buf = par->cursor.buf;
+    par->cursor.xfer.speed_hz = disp.write_speed_hz;
+    spi_message_init_with_transfers(&par->cursor.msg, &par->cursor.xfer, 1);
+
+    par->tftops = &default_ili9488_ops;
+    par->display = disp;
+    par->mode.three_bit = disp.three_bit;
+    par->mode.dither = disp.three_bit && disp.dither;
+    par->mode.fps = disp.fps;
+    info->var.nonstd = ili9488_mode_to_nonstd(&par->mode);
 
     dev_set_drvdata(dev, par);
     spi_set_drvdata(spi, par);
 
     spin_lock_init(&par->dirty_lock);
+    par->damage.hub = ili9488_damage_hub_alloc();
+    if (!par->damage.hub) {
+        rc = -ENOMEM;
+        goto err_defio;
+    }
+    /* no video frame in flight yet */
     init_completion(&par->complete);
+    complete_all(&par->complete);
+    mutex_init(&par->video.lock);
+    mutex_init(&par->io_lock);
     ili9488_of_config(par);
 
     ili9488_hw_init(par);
 
-    update_display(par, 0, par->fbinfo->var.yres - 1);
+    /* the glyph cache renders RGB565 cells */
+    if (p_tileblit && bpp == 16 && ili9488_tile_init(par))
+        dev_warn(dev, "tile blitting disabled, out of memory\n");
+
+    update_display(par, 0, 0, par->fbinfo->var.xres - 1, par->fbinfo->var.yres - 1);
+
+    par->dirty_lines_start = par->fbinfo->var.yres - 1;
+    par->dirty_lines_end = 0;
+    rc = ili9488_flush_worker_init(par);
+    if (rc) {
+        dev_err(dev, "failed to create flush thread: %d\n", rc);
+        goto err_tile;
+    }
+
+    if (bpp == 8) {
+        /* starts out with the default console colours */
+        rc = fb_alloc_cmap(&info->cmap, 256, 0);
+        if (rc)
+            goto err_worker;
+        fb_set_cmap(&info->cmap, info);
+    }
+
+    /* named after the SPI device, so a second panel gets its own nodes */
+    par->damage.misc.minor = MISC_DYNAMIC_MINOR;
+    par->damage.misc.name = devm_kasprintf(dev, GFP_KERNEL, "ili9488_damage-%s",
+                                           dev_name(dev));
+    if (!par->damage.misc.name) {
+        rc = -ENOMEM;
+        goto err_cmap;
+    }
+    par->damage.misc.fops = &ili9488_damage_fops;
+    par->damage.misc.parent = dev;
+    rc = misc_register(&par->damage.misc);
+    if (rc) {
+        dev_err(dev, "failed to register damage device: %d\n", rc);
+        goto err_cmap;
+    }
+
+    snprintf(name, sizeof(name), DRV_NAME "-%s", dev_name(dev));
+    par->debugfs = debugfs_create_dir(name, NULL);
+    debugfs_create_file("stats", 0444, par->debugfs, par, &ili9488_stats_fops);
+
+    /*
+     * Flushes hold a runtime PM reference, the panel drops to idle or
+     * sleep once they stop for p_pm_delay_ms. With p_pm_mode 0 it only
+     * sleeps while blanked, unblanked it holds a reference of its own.
+     */
+    par->pm.state = ILI9488_PM_ACTIVE;
+    par->pm.since = ktime_get();
+    par->pm.hold = !p_pm_mode;
+    pm_runtime_set_autosuspend_delay(dev, p_pm_delay_ms);
+    pm_runtime_use_autosuspend(dev);
+    pm_runtime_set_active(dev);
+    if (par->pm.hold)
+        pm_runtime_get_noresume(dev);
+    rc = devm_pm_runtime_enable(dev);
+    if (rc)
+        goto err_pm;
+    pm_runtime_mark_last_busy(dev);
+    pm_request_autosuspend(dev);
+
+    rc = sysfs_create_groups(&dev->kobj, ili9488_attr_groups);
+    if (rc) {
+        dev_err(dev, "failed to create sysfs group\n");
+        goto err_pm_enabled;
+    }
+
     /* framebuffer register */
     rc = register_framebuffer(info);
     if (rc < 0) {
         dev_err(dev, "framebuffer register failed with %d!\n", rc);
-        goto alloc_fail;
+        goto err_sysfs;
     }
 
     /* Notify backlight that display is starting in unblank state */
@@ -1184,44 +3629,130 @@ static int ili9488_probe(struct spi_device *spi)
 
     return 0;
 
-alloc_fail:
+err_sysfs:
+    sysfs_remove_groups(&dev->kobj, ili9488_attr_groups);
+err_pm_enabled:
+    /* as in remove, keep the PM callbacks off par while it goes away */
+    pm_runtime_get_sync(dev);
+    pm_runtime_put_noidle(dev);
+err_pm:
+    if (par->pm.hold)
+        pm_runtime_put_noidle(dev);
+    debugfs_remove_recursive(par->debugfs);
+    misc_deregister(&par->damage.misc);
+err_cmap:
+    fb_dealloc_cmap(&info->cmap);
+err_worker:
+    ili9488_flush_worker_destroy(par);
+err_tile:
+    ili9488_tile_free(&par->tile);
+    kvfree(par->lut_buf);
+err_defio:
+    ili9488_damage_hub_kill(par->damage.hub);
+    fb_deferred_io_cleanup(info);
+    framebuffer_release(info);
+err_vmem:
     vfree(vmem);
-    return 0;
+    return rc;
 }
 
 static void ili9488_remove(struct spi_device *spi)
 {
     struct ili9488_par *par = spi_get_drvdata(spi);
+    void *vmem;
 
-    fb_deferred_io_cleanup(par->fbinfo);
+    /* keep the PM callbacks off par until runtime PM is disabled */
+    pm_runtime_get_sync(par->dev);
+
+    sysfs_remove_groups(&par->dev->kobj, ili9488_attr_groups);
+    misc_deregister(&par->damage.misc);
+    /* nothing can dirty vmem or queue flushes once the fb is gone */
     unregister_framebuffer(par->fbinfo);
+    fb_deferred_io_cleanup(par->fbinfo);
+    ili9488_flush_worker_destroy(par);
+    /* open damage readers get EOF and keep the hub until they close */
+    ili9488_damage_hub_kill(par->damage.hub);
+    debugfs_remove_recursive(par->debugfs);
+    ili9488_tile_free(&par->tile);
+    fb_dealloc_cmap(&par->fbinfo->cmap);
+    kvfree(par->lut_buf);
+
+    if (par->pm.hold)
+        pm_runtime_put_noidle(par->dev);
+    pm_runtime_put_noidle(par->dev);
+    vmem = par->fbinfo->screen_buffer;
     framebuffer_release(par->fbinfo);
+    vfree(vmem);
 }
 
+/* a blanked panel always sleeps, otherwise p_pm_mode picks idle or sleep */
 static int __maybe_unused ili9488_runtime_suspend(struct device *dev)
 {
-    // struct ili9488_par *par = dev_get_drvdata(dev);
+    struct ili9488_par *par = dev_get_drvdata(dev);
+    enum ili9488_pm_state state = ILI9488_PM_SLEEP;
+    s64 awake_ms;
 
-    // par->tftops->sleep(par, true);
+    spin_lock(&par->dirty_lock);
+    if (!par->blanked && p_pm_mode == 1)
+        state = ILI9488_PM_IDLE;
+    spin_unlock(&par->dirty_lock);
+
+    mutex_lock(&par->io_lock);
+    ili9488_pm_wake_wait(par);
+
+    if (state == ILI9488_PM_SLEEP) {
+        if (par->pm.wake_from == ILI9488_PM_SLEEP) {
+            awake_ms = ktime_ms_delta(ktime_get(), par->pm.wake_start);
+            if (awake_ms < ILI9488_SLEEP_OUT_GUARD_MS)
+                msleep(ILI9488_SLEEP_OUT_GUARD_MS - awake_ms);
+        }
+        par->tftops->sleep(par, true);
+    } else {
+        par->tftops->idle(par, true);
+    }
+    ili9488_pm_set_state(par, state);
+    mutex_unlock(&par->io_lock);
+
+    dev_dbg(dev, "%s, panel %s\n", __func__, ili9488_pm_names[state]);
 
     return 0;
 }
 
+/*
+ * Only start the exit here. Sleep out needs a few ms before the next
+ * command, that wait is done by ili9488_pm_wake_wait() right before the
+ * first command so it overlaps with converting the damage.
+ */
 static int __maybe_unused ili9488_runtime_resume(struct device *dev)
 {
-    // struct ili9488_par *par = dev_get_drvdata(dev);
+    struct ili9488_par *par = dev_get_drvdata(dev);
 
-    // par->tftops->sleep(par, false);
+    mutex_lock(&par->io_lock);
+    par->pm.wake_from = par->pm.state;
+    par->pm.wake_start = ktime_get();
+    par->pm.wake_ready = par->pm.wake_start;
+
+    switch (par->pm.state) {
+    case ILI9488_PM_IDLE:
+        par->tftops->idle(par, false);
+        par->pm.waking = true;
+        break;
+    case ILI9488_PM_SLEEP:
+        par->tftops->sleep(par, false);
+        par->pm.wake_ready = ktime_add_us(par->pm.wake_start, ILI9488_SLEEP_OUT_US);
+        par->pm.waking = true;
+        break;
+    default:
+        break;
+    }
+    ili9488_pm_set_state(par, ILI9488_PM_ACTIVE);
+    mutex_unlock(&par->io_lock);
 
     return 0;
 }
 
 static int __maybe_unused ili9488_runtime_idle(struct device *dev)
 {
-    // struct ili9488_par *par = dev_get_drvdata(dev);
-
-    // par->tftops->idle(par, true);
-
     return 0;
 }
 
@@ -1249,7 +3780,7 @@ static struct spi_driver ili9488_spi_drv = {
     .driver   = {
         .name           = DRV_NAME,
         .of_match_table = of_match_ptr(ili9488_dt_ids),
-        // .pm             = &ili9488_pm_ops
+        .pm             = &ili9488_pm_ops,
     },
 };
 
@@ -0,0 +1,59 @@
+#ifndef ILI9488_FB_H
+#define ILI9488_FB_H
+
+/* driver specific ioctls on the ili9488 framebuffer, also used by userspace */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* source layouts for ILI9488_IOC_YUV_FRAME */
+#define ILI9488_YUV_I420            0   /* Y plane, then U and V planes at half size */
+#define ILI9488_YUV_NV12            1   /* Y plane, then one interleaved UV plane */
+
+/* downscaling applied on the way to the panel */
+#define ILI9488_YUV_SCALE_NONE      0
+#define ILI9488_YUV_SCALE_NEAREST   1   /* 2x down, top left sample of each 2x2 block */
+#define ILI9488_YUV_SCALE_BILINEAR  2   /* 2x down, average of each 2x2 block */
+
+struct ili9488_yuv_frame {
+    __u32 format;
+    __u32 scale;
+    __u32 width;        /* source size in pixels, both even */
+    __u32 height;
+    __u32 y_stride;     /* bytes per line of the Y plane */
+    __u32 uv_stride;    /* bytes per line of the U and V (or UV) planes */
+    __u64 y;            /* user pointers to the planes, v is unused for NV12 */
+    __u64 u;
+    __u64 v;
+    __u32 dst_x;        /* top left of the destination rectangle, x even */
+    __u32 dst_y;
+};
+
+/*
+ * Convert a BT.601 limited range frame straight into the panel wire format
+ * and send it, vmem is not touched for the destination rectangle. Returns
+ * once the frame is converted and the previous one has gone out, so a
+ * player calling it in a loop is paced by the panel.
+ */
+#define ILI9488_IOC_YUV_FRAME       _IOW('F', 0x90, struct ili9488_yuv_frame)
+
+/*
+ * Records read() from /dev/ili9488_damage-<spi device>, one per rectangle
+ * of vmem sent to the panel. Rectangles of the same flush share seq. A
+ * reader that falls behind gets a single ILI9488_DAMAGE_OVERFLOW record
+ * covering the whole screen instead of the ones it missed. Once the panel is removed
+ * read() returns 0 and poll() reports EPOLLHUP.
+ */
+#define ILI9488_DAMAGE_OVERFLOW     (1 << 0)
+
+struct ili9488_damage {
+    __u32 seq;
+    __u32 flags;
+    __u16 x;
+    __u16 y;
+    __u16 width;
+    __u16 height;
+    __u64 timestamp_ns; /* CLOCK_MONOTONIC */
+};
+
+#endif
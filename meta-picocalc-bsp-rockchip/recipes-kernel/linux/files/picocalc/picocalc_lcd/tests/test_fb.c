@@ -10,6 +10,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "../ili9488_fb.h"
 
 
 
@@ -4739,15 +4743,164 @@ int lcd_put_string(int x, int y, unsigned int color, unsigned char *str)
 
 }
 
+/* more flushes than the driver queues per damage reader */
+#define DAMAGE_FLUSHES	160
+
+static int damage_read(int fd, struct ili9488_damage *ev, int n)
+{
+	ssize_t len = read(fd, ev, n * sizeof(*ev));
+
+	if (len < 0)
+		return errno == EAGAIN ? 0 : -1;
+	if (len % sizeof(*ev)) {
+		printf("damage: short record, read %zd bytes\n", len);
+		return -1;
+	}
+	return len / sizeof(*ev);
+}
+
+static int damage_wait(int fd, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, timeout_ms) != 1 || !(pfd.revents & POLLIN)) {
+		printf("damage: no record within %d ms\n", timeout_ms);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The damage node is named after the SPI device, which is also the parent
+ * of the framebuffer device.
+ */
+static int damage_path(char *path, size_t len)
+{
+	char link[256];
+	const char *dev;
+	ssize_t n;
+
+	n = readlink("/sys/class/graphics/fb0/device", link, sizeof(link) - 1);
+	if (n < 0)
+		return -1;
+	link[n] = '\0';
+	dev = strrchr(link, '/');
+	snprintf(path, len, "/dev/ili9488_damage-%s", dev ? dev + 1 : link);
+	return 0;
+}
+
+/*
+ * Check the /dev/ili9488_damage-* ABI: records of a drawn string cover it,
+ * poll() wakes up for them, and a reader that never reads gets a single
+ * full screen overflow record while another one keeps up.
+ */
+static int damage_test(void)
+{
+	struct ili9488_damage ev[16];
+	int fd, fd_lazy, n, i, k, hit = 0, lazy = 0;
+	unsigned int last_seq = 0;
+	char path[300];
+
+	if (damage_path(path, sizeof(path)) < 0) {
+		printf("can`t find the fb0 device\n");
+		return -1;
+	}
+	fd = open(path, O_RDONLY | O_NONBLOCK);
+	fd_lazy = open(path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0 || fd_lazy < 0) {
+		printf("can`t open %s\n", path);
+		return -1;
+	}
+
+	/* let the clear of main() go out, then start from empty queues */
+	usleep(200000);
+	while ((n = damage_read(fd, ev, 16)) > 0)
+		;
+	while ((n = damage_read(fd_lazy, ev, 16)) > 0)
+		;
+	if (n < 0 || damage_read(fd, ev, 16) != 0) {
+		printf("damage: empty queue did not return EAGAIN\n");
+		return -1;
+	}
+
+	if (read(fd, ev, sizeof(ev[0]) - 1) >= 0 || errno != EINVAL) {
+		printf("damage: undersized read was accepted\n");
+		return -1;
+	}
+
+	lcd_put_string(16, 32, 0xFFFFFF, (unsigned char *)"damage");
+	if (damage_wait(fd, 1000))
+		return -1;
+	while ((n = damage_read(fd, ev, 16)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (ev[i].flags || ev[i].x + ev[i].width > var.xres ||
+			    ev[i].y + ev[i].height > var.yres) {
+				printf("damage: bad record %u %u,%u %ux%u\n", ev[i].flags,
+				       ev[i].x, ev[i].y, ev[i].width, ev[i].height);
+				return -1;
+			}
+			if (ev[i].y <= 32 && ev[i].y + ev[i].height >= 48 &&
+			    ev[i].x <= 16 && ev[i].x + ev[i].width >= 16 + 6 * 8)
+				hit = 1;
+		}
+	}
+	if (n < 0 || !hit) {
+		printf("damage: drawn string not covered\n");
+		return -1;
+	}
+	printf("damage: records cover the drawn string\n");
+
+	/* fd keeps up, fd_lazy is left alone until the end */
+	for (k = 0; k < DAMAGE_FLUSHES; k++) {
+		lcd_put_ascii((k % 40) * 8, 64, 0xFFFFFF, 'a' + k % 26);
+		if (damage_wait(fd, 1000))
+			return -1;
+		while ((n = damage_read(fd, ev, 16)) > 0) {
+			for (i = 0; i < n; i++) {
+				if (ev[i].seq < last_seq) {
+					printf("damage: seq went back %u < %u\n",
+					       ev[i].seq, last_seq);
+					return -1;
+				}
+				last_seq = ev[i].seq;
+			}
+		}
+		if (n < 0)
+			return -1;
+	}
+
+	while ((n = damage_read(fd_lazy, ev, 16)) > 0) {
+		for (i = 0; i < n; i++, lazy++) {
+			if (lazy || ev[i].flags != ILI9488_DAMAGE_OVERFLOW)
+				continue;
+			if (ev[i].x || ev[i].y || ev[i].width != var.xres ||
+			    ev[i].height != var.yres) {
+				printf("damage: overflow record is not the whole screen\n");
+				return -1;
+			}
+			printf("damage: overflow reported, seq %u\n", ev[i].seq);
+		}
+	}
+	if (n < 0 || lazy != 1) {
+		printf("damage: lazy reader got %d records, expected one overflow\n", lazy);
+		return -1;
+	}
+
+	close(fd_lazy);
+	close(fd);
+	printf("damage: ok\n");
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int fd_fb;
 	int fd_hzk16;
-	int i;
+	int i = 0;
 	unsigned int screen_size;
 
 	if(argc < 2){
-		printf("usage: %s [x] [y] [color] <str>\n",argv[0]);
+		printf("usage: %s [x] [y] [color] <str> | -d\n",argv[0]);
 		return -1;
 	}
 	
@@ -4788,7 +4941,9 @@ int main(int argc, char **argv)
 	memset(fb_base, 0, screen_size);
 	printf("%s, cleaned screen\n.",__func__);
 
-	if(argc == 4)
+	if(argc == 2 && !strcmp(argv[1], "-d"))
+	i = damage_test();
+	else if(argc == 4)
 	lcd_put_string(atoi(argv[1]) , atoi(argv[2]) , 0xFFFFFF,argv[3]);
 	else if(argc == 5)
 	lcd_put_string(atoi(argv[1]) , atoi(argv[2]) , atoi(argv[3]), argv[4]);
@@ -4798,7 +4953,7 @@ int main(int argc, char **argv)
 	munmap(fb_base, screen_size);
 	close(fd_fb);
 	
-	return 0;
+	return i;
 }
 
 
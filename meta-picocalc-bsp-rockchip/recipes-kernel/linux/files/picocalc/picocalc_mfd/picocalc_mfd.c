@@ -8,59 +8,373 @@
  * for the various functions provided by the peripheral (keyboard, power, etc.).
  * It sets up a regmap to provide safe, shared access to the device registers
  * for all child drivers.
+ *
+ * When the MCU's interrupt line is wired up, REG_ID_INT is demultiplexed
+ * through an irq domain so children get one virtual IRQ per source bit.
+ * Without it the children fall back to polling.
+ *
+ * The firmware type and version are read at probe along with a feature
+ * bitmap and the register layout, children look them up through
+ * picocalc_mfd_get_fw(). Block reads are detected on the MCU itself, the
+ * fast paths that cannot be tried without side effects are enabled with
+ * fw_features.
+ *
+ * Children share the bus through picocalc_mfd_read() and friends: slow
+ * changing registers are kept in a snapshot for a while after a read,
+ * neighbours fetched in the same block read, other accesses wait for the
+ * bus in priority order with the keyboard first.
+ *
+ * The regmap hides the MCU's framing: reads answer [register, value] and
+ * writes need MSB_MASK on the address. Registers only the host changes
+ * are cached, so repeated reads of them never reach the bus.
+ *
+ * Every transfer is accounted to the child that caused it, or to "core"
+ * for the MFD's own traffic, see picocalc_mfd/bus in debugfs and the
+ * picocalc_mfd trace events.
  */
 
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
 #include <linux/i2c.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/irqdomain.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/mfd/core.h>
 #include <linux/module.h>
 #include <linux/of_platform.h>
 #include <linux/regmap.h>
 #include <linux/reboot.h>
 
-#include "picocalc_reg.h"
+#include "picocalc_mfd.h"
+
+#define CREATE_TRACE_POINTS
+#include "picocalc_mfd_trace.h"
+
+/* bitmap of PICOCALC_FEAT_*, -1 keeps what probe detected, anything else replaces it */
+static long fw_features = -1;
+module_param(fw_features, long, 0444);
+
+/*
+ * extra attempts after a NAK, lost arbitration or timeout, only for reads
+ * that have no side effect: a write or a FIFO read may have reached the
+ * MCU before the error, and repeating it would act twice
+ */
+static uint xfer_retries;
+module_param(xfer_retries, uint, 0644);
+
+static const struct picocalc_mfd_regs picocalc_mfd_regs_v1 = {
+    .typ = REG_ID_TYP,
+    .ver = REG_ID_VER,
+    .cfg = REG_ID_CFG,
+    .irq = REG_ID_INT,
+    .key = REG_ID_KEY,
+    .bkl = REG_ID_BKL,
+    .deb = REG_ID_DEB,
+    .frq = REG_ID_FRQ,
+    .rst = REG_ID_RST,
+    .fif = REG_ID_FIF,
+    .bk2 = REG_ID_BK2,
+    .bat = REG_ID_BAT,
+    .c64_mtx = REG_ID_C64_MTX,
+    .c64_js = REG_ID_C64_JS,
+    .off = REG_ID_OFF,
+};
+
+
+/*
+ * Registers the MCU changes behind our back, only read when a child asks
+ * and the last value is older than max_age_ms. None of them has side
+ * effects on read. Sorted by address so neighbours go out in the same
+ * block read.
+ *
+ * There is no periodic read of the whole 0x03-0x0B window: FIF pops the
+ * key FIFO and RST resets the MCU when read, so a block read crossing
+ * them is not safe. Only runs of snapshot registers are shared, BK2 and
+ * BAT in the official layout, and only on an MCU that passed the block
+ * read probe.
+ */
+#define PICOCALC_SNAP_NR 3
+
+struct picocalc_mfd_snap {
+    u8 reg;
+    u16 max_age_ms;
+    bool valid;
+    u8 val;
+    ktime_t stamp;
+    /* bumped on every invalidation, a read that started before is not stored */
+    u32 gen;
+};
+
+struct picocalc_mfd_waiter {
+    struct list_head node;
+    enum picocalc_mfd_prio prio;
+    struct completion granted;
+};
+
+/* per register, reads are picocalc_mfd_read() calls */
+struct picocalc_mfd_reg_stats {
+    u64 reads;
+    u64 hits;
+    u64 bus_reads;
+    u64 bus_writes;
+};
+
+/*
+ * Latency histogram buckets in microseconds, bucket 0 is below 64 and
+ * bucket i above that covers [32 << i, 64 << i).
+ */
+#define PICOCALC_LAT_NR 10
+
+/* slot 0 is the MFD itself, children get the others on first access */
+#define PICOCALC_CLIENT_NR 8
+
+struct picocalc_mfd_client {
+    struct device *dev;
+    char name[32];
+    u64 transactions;
+    u64 bytes;
+    u64 errors;
+    u64 retries;
+    u64 busy_ns;
+    u64 xfer_hist[PICOCALC_LAT_NR];
+    u64 wait_hist[PICOCALC_LAT_NR];
+};
 
 struct picocalc_mfd_data {
 	u32 poweroff_reg;
-};
+    struct picocalc_mfd_fw fw;
 
-/* This regmap config assumes 8-bit register addresses and 8-bit values */
-static const struct regmap_config picocalc_mfd_regmap_config = {
-    .reg_bits = 8,
-    .val_bits = 8,
+    struct device *dev;
+    struct i2c_client *i2c;
+    struct regmap *regmap;
+    struct dentry *debugfs;
+    struct picocalc_mfd_reg_stats reg_stats[REG_ID_OFF + 1];
+
+    /* bus accounting, cur_client is whoever holds the bus */
+    spinlock_t client_lock;
+    struct picocalc_mfd_client clients[PICOCALC_CLIENT_NR];
+    struct picocalc_mfd_client *cur_client;
+    ktime_t stats_start;
+    ktime_t duty_stamp;
+    u64 duty_busy_ns;
+    struct irq_domain *irq_domain;
+    /* REG_ID_INT sources with an unmasked child handler */
+    unsigned long irq_enabled;
+    /* ktime when the line last fired, before the thread got to run, atomic64 for 32 bit */
+    atomic64_t irq_stamp;
+
+    /* bus arbitration, waiters sorted by priority */
+    spinlock_t bus_lock;
+    bool bus_busy;
+    struct list_head bus_waiters;
+
+    struct mutex snap_lock;
+    struct picocalc_mfd_snap snap[PICOCALC_SNAP_NR];
 };
 
-static ssize_t fw_version_show(struct device *dev, struct device_attribute *attr, char *buf)
+static unsigned int picocalc_mfd_lat_bucket(u64 ns)
+{
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+
+    if (us < 64)
+        return 0;
+
+    return min_t(unsigned int, ilog2(us) - 5, PICOCALC_LAT_NR - 1);
+}
+
+static bool picocalc_mfd_precious_reg(struct device *dev, unsigned int reg);
+
+/*
+ * Every byte to or from the MCU goes through here. The bus owner's
+ * client takes the cost, probe runs outside the arbiter and is charged
+ * to core. Clients share slot 0 once the table is full, so the counters
+ * are only touched under client_lock.
+ */
+static int picocalc_mfd_transfer(struct picocalc_mfd_data *data, u8 reg,
+                                 struct i2c_msg *msgs, int num)
+{
+    struct picocalc_mfd_client *client = data->cur_client;
+    bool write = !(msgs[num - 1].flags & I2C_M_RD);
+    unsigned int retries = 0, len = 0, max_retries = 0;
+    ktime_t start = ktime_get();
+    u64 ns;
+    int ret, i;
+
+    for (i = 0; i < num; i++)
+        len += msgs[i].len;
+
+    if (!write && !picocalc_mfd_precious_reg(data->dev, reg))
+        max_retries = READ_ONCE(xfer_retries);
+
+    for (;;) {
+        ret = i2c_transfer(data->i2c->adapter, msgs, num);
+        if (ret >= 0)
+            ret = ret == num ? 0 : -EIO;
+        if (ret != -EAGAIN && ret != -EREMOTEIO && ret != -ENXIO && ret != -ETIMEDOUT)
+            break;
+        if (retries >= max_retries)
+            break;
+        retries++;
+    }
+
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    spin_lock(&data->client_lock);
+    client->transactions++;
+    client->bytes += len;
+    client->retries += retries;
+    client->busy_ns += ns;
+    client->xfer_hist[picocalc_mfd_lat_bucket(ns)]++;
+    if (ret)
+        client->errors++;
+    spin_unlock(&data->client_lock);
+
+    trace_picocalc_mfd_xfer(client->name, reg, write, len, ret, retries, ns);
+
+    return ret;
+}
+
+/* write reg, read len raw bytes back, no caching and no decoding */
+static int picocalc_mfd_raw_read(struct picocalc_mfd_data *data, u8 reg,
+                                 void *buf, size_t len)
+{
+    struct i2c_msg msgs[2] = {
+        { .addr = data->i2c->addr, .flags = 0, .len = 1, .buf = &reg },
+        { .addr = data->i2c->addr, .flags = I2C_M_RD, .len = len, .buf = buf },
+    };
+
+    return picocalc_mfd_transfer(data, reg, msgs, ARRAY_SIZE(msgs));
+}
+
+/* reads answer [register, value], a one byte read would only see the echo */
+static int picocalc_mfd_reg_read(void *context, unsigned int reg, unsigned int *val)
 {
-    struct regmap *regmap = dev_get_regmap(dev, NULL);
-    unsigned int version;
+    struct picocalc_mfd_data *data = context;
+    u8 buf[2];
     int ret;
 
-    ret = regmap_read(regmap, REG_ID_VER, &version);
+    ret = picocalc_mfd_raw_read(data, reg, buf, sizeof(buf));
     if (ret < 0)
         return ret;
 
-    return sysfs_emit(buf, "0x%02x\n", version);
+    data->reg_stats[reg].bus_reads++;
+    *val = buf[1];
+    return 0;
 }
-static DEVICE_ATTR_RO(fw_version);
 
-static ssize_t fw_type_show(struct device *dev, struct device_attribute *attr, char *buf)
+static int picocalc_mfd_reg_write(void *context, unsigned int reg, unsigned int val)
 {
-    struct regmap *regmap = dev_get_regmap(dev, NULL);
-    unsigned int type;
+    struct picocalc_mfd_data *data = context;
+    u8 buf[2] = { reg | MSB_MASK, val };
+    struct i2c_msg msg = {
+        .addr = data->i2c->addr, .flags = 0, .len = sizeof(buf), .buf = buf,
+    };
     int ret;
 
-    ret = regmap_read(regmap, REG_ID_TYP, &type);
+    ret = picocalc_mfd_transfer(data, reg, &msg, 1);
     if (ret < 0)
         return ret;
 
-    return sysfs_emit(buf, "0x%02x\n", type);
+    data->reg_stats[reg].bus_writes++;
+    return 0;
+}
+
+static bool picocalc_mfd_readable_reg(struct device *dev, unsigned int reg)
+{
+    return reg != REG_ID_OFF;
+}
+
+static bool picocalc_mfd_writeable_reg(struct device *dev, unsigned int reg)
+{
+    switch (reg) {
+    case REG_ID_CFG:
+    case REG_ID_INT:    /* written as 0 to acknowledge */
+    case REG_ID_BKL:
+    case REG_ID_DEB:
+    case REG_ID_FRQ:
+    case REG_ID_RST:
+    case REG_ID_BK2:
+    case REG_ID_OFF:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* the keyboard's own keys change both backlights, the snapshot covers them */
+static bool picocalc_mfd_volatile_reg(struct device *dev, unsigned int reg)
+{
+    switch (reg) {
+    case REG_ID_INT:
+    case REG_ID_KEY:
+    case REG_ID_BKL:
+    case REG_ID_RST:
+    case REG_ID_FIF:
+    case REG_ID_BK2:
+    case REG_ID_BAT:
+    case REG_ID_C64_MTX:
+    case REG_ID_C64_JS:
+    case REG_ID_OFF:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* reading these pops the FIFO or resets the MCU, never do it behind a child's back */
+static bool picocalc_mfd_precious_reg(struct device *dev, unsigned int reg)
+{
+    return reg == REG_ID_FIF || reg == REG_ID_RST;
+}
+
+/* addresses are those of the v1 layout, the only one known so far */
+static const struct regmap_config picocalc_mfd_regmap_config = {
+    .reg_bits = 8,
+    .val_bits = 8,
+    .max_register = REG_ID_OFF,
+    .reg_read = picocalc_mfd_reg_read,
+    .reg_write = picocalc_mfd_reg_write,
+    .readable_reg = picocalc_mfd_readable_reg,
+    .writeable_reg = picocalc_mfd_writeable_reg,
+    .volatile_reg = picocalc_mfd_volatile_reg,
+    .precious_reg = picocalc_mfd_precious_reg,
+    /* 6.1 has no maple cache yet, the rbtree does the same for 15 registers */
+    .cache_type = REGCACHE_RBTREE,
+};
+
+/* the firmware does not change under us, report what probe negotiated */
+static ssize_t fw_version_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct picocalc_mfd_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "0x%02x\n", data->fw.version);
+}
+static DEVICE_ATTR_RO(fw_version);
+
+static ssize_t fw_type_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct picocalc_mfd_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "0x%02x\n", data->fw.type);
 }
 static DEVICE_ATTR_RO(fw_type);
 
+static ssize_t fw_features_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct picocalc_mfd_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "0x%02lx\n", data->fw.features);
+}
+static DEVICE_ATTR_RO(fw_features);
+
 static struct attribute *picocalc_mfd_attrs[] = {
     &dev_attr_fw_version.attr,
     &dev_attr_fw_type.attr,
+    &dev_attr_fw_features.attr,
     NULL,
 };
 
@@ -68,10 +382,606 @@ static const struct attribute_group picocalc_mfd_attr_group = {
     .attrs = picocalc_mfd_attrs,
 };
 
+const struct picocalc_mfd_fw *picocalc_mfd_get_fw(struct device *child)
+{
+    struct picocalc_mfd_data *data = dev_get_drvdata(child->parent);
+
+    return &data->fw;
+}
+EXPORT_SYMBOL_GPL(picocalc_mfd_get_fw);
+
+/* the slot for a child, shared with core once all are taken */
+static struct picocalc_mfd_client *picocalc_mfd_client_find(struct picocalc_mfd_data *data,
+                                                            struct device *child)
+{
+    struct picocalc_mfd_client *client = &data->clients[0];
+    int i;
+
+    spin_lock(&data->client_lock);
+    for (i = 1; i < PICOCALC_CLIENT_NR; i++) {
+        if (data->clients[i].dev == child) {
+            client = &data->clients[i];
+            break;
+        }
+        if (!data->clients[i].dev) {
+            client = &data->clients[i];
+            client->dev = child;
+            strscpy(client->name, dev_name(child), sizeof(client->name));
+            break;
+        }
+    }
+    spin_unlock(&data->client_lock);
+
+    return client;
+}
+
+static void picocalc_mfd_bus_granted(struct picocalc_mfd_data *data,
+                                     struct picocalc_mfd_client *client,
+                                     enum picocalc_mfd_prio prio, ktime_t start)
+{
+    u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    data->cur_client = client;
+    spin_lock(&data->client_lock);
+    client->wait_hist[picocalc_mfd_lat_bucket(ns)]++;
+    spin_unlock(&data->client_lock);
+    trace_picocalc_mfd_bus_wait(client->name, prio, ns);
+}
+
+static void picocalc_mfd_bus_get(struct picocalc_mfd_data *data,
+                                 struct picocalc_mfd_client *client,
+                                 enum picocalc_mfd_prio prio)
+{
+    struct picocalc_mfd_waiter w, *pos;
+    ktime_t start = ktime_get();
+
+    spin_lock(&data->bus_lock);
+    if (!data->bus_busy) {
+        data->bus_busy = true;
+        spin_unlock(&data->bus_lock);
+        picocalc_mfd_bus_granted(data, client, prio, start);
+        return;
+    }
+
+    w.prio = prio;
+    init_completion(&w.granted);
+    /* behind everyone of the same or a more urgent priority */
+    list_for_each_entry(pos, &data->bus_waiters, node) {
+        if (pos->prio > prio)
+            break;
+    }
+    list_add_tail(&w.node, &pos->node);
+    spin_unlock(&data->bus_lock);
+
+    wait_for_completion(&w.granted);
+    picocalc_mfd_bus_granted(data, client, prio, start);
+}
+
+/* hands the bus straight to the first waiter */
+static void picocalc_mfd_bus_put(struct picocalc_mfd_data *data)
+{
+    struct picocalc_mfd_waiter *w;
+
+    data->cur_client = &data->clients[0];
+
+    spin_lock(&data->bus_lock);
+    w = list_first_entry_or_null(&data->bus_waiters,
+                                 struct picocalc_mfd_waiter, node);
+    if (w) {
+        list_del(&w->node);
+        complete(&w->granted);
+    } else {
+        data->bus_busy = false;
+    }
+    spin_unlock(&data->bus_lock);
+}
+
+static struct picocalc_mfd_snap *picocalc_mfd_snap_find(struct picocalc_mfd_data *data,
+                                                        u8 reg)
+{
+    int i;
+
+    for (i = 0; i < PICOCALC_SNAP_NR; i++) {
+        if (data->snap[i].reg == reg)
+            return &data->snap[i];
+    }
+
+    return NULL;
+}
+
+/* helpers called with snap_lock held */
+static bool picocalc_mfd_snap_fresh(struct picocalc_mfd_snap *snap, ktime_t now)
+{
+    return snap->valid && ktime_ms_delta(now, snap->stamp) <= snap->max_age_ms;
+}
+
+static void picocalc_mfd_snap_invalidate(struct picocalc_mfd_snap *snap)
+{
+    snap->valid = false;
+    snap->gen++;
+}
+
+/*
+ * Fetch snap[k] from the bus. With block reads its neighbours at
+ * consecutive addresses come along in the same transfer, fresh or not,
+ * so whichever child reads next finds them in the snapshot. Entries
+ * invalidated while the read was out keep their invalidation, the value
+ * read is still returned to the caller.
+ */
+static int picocalc_mfd_snap_refresh(struct picocalc_mfd_data *data,
+                                     struct picocalc_mfd_client *client,
+                                     int k, enum picocalc_mfd_prio prio, u8 *val)
+{
+    bool block = picocalc_mfd_has(&data->fw, PICOCALC_FEAT_BLOCK_READ);
+    struct picocalc_mfd_snap *snap = data->snap;
+    u32 gen[PICOCALC_SNAP_NR];
+    u8 buf[PICOCALC_SNAP_NR + 1];
+    ktime_t now;
+    int lo = k, hi = k, i, ret;
+    unsigned int v;
+
+    mutex_lock(&data->snap_lock);
+    while (block && lo > 0 && snap[lo - 1].reg + 1 == snap[lo].reg)
+        lo--;
+    while (block && hi + 1 < PICOCALC_SNAP_NR && snap[hi].reg + 1 == snap[hi + 1].reg)
+        hi++;
+    for (i = lo; i <= hi; i++)
+        gen[i] = snap[i].gen;
+    mutex_unlock(&data->snap_lock);
+
+    picocalc_mfd_bus_get(data, client, prio);
+    if (hi > lo) {
+        ret = picocalc_mfd_raw_read(data, snap[lo].reg, buf, hi - lo + 2);
+        for (i = lo; ret >= 0 && i <= hi; i++)
+            data->reg_stats[snap[i].reg].bus_reads++;
+    } else {
+        ret = regmap_read(data->regmap, snap[k].reg, &v);
+        buf[1] = v;
+    }
+    picocalc_mfd_bus_put(data);
+    if (ret < 0)
+        return ret;
+
+    mutex_lock(&data->snap_lock);
+    now = ktime_get();
+    for (i = lo; i <= hi; i++) {
+        if (snap[i].gen != gen[i])
+            continue;
+        snap[i].val = buf[i - lo + 1];
+        snap[i].valid = true;
+        snap[i].stamp = now;
+    }
+    mutex_unlock(&data->snap_lock);
+
+    *val = buf[k - lo + 1];
+    return 0;
+}
+
+int picocalc_mfd_bulk_read(struct device *child, u8 reg, void *buf,
+                           size_t len, enum picocalc_mfd_prio prio)
+{
+    struct picocalc_mfd_data *data = dev_get_drvdata(child->parent);
+    int ret;
+
+    picocalc_mfd_bus_get(data, picocalc_mfd_client_find(data, child), prio);
+    ret = picocalc_mfd_raw_read(data, reg, buf, len);
+    picocalc_mfd_bus_put(data);
+
+    return ret;
+}
+EXPORT_SYMBOL_GPL(picocalc_mfd_bulk_read);
+
+int picocalc_mfd_read(struct device *child, u8 reg, u8 *val,
+                      enum picocalc_mfd_prio prio)
+{
+    struct picocalc_mfd_data *data = dev_get_drvdata(child->parent);
+    struct picocalc_mfd_client *client = picocalc_mfd_client_find(data, child);
+    struct picocalc_mfd_snap *snap = picocalc_mfd_snap_find(data, reg);
+    struct picocalc_mfd_reg_stats *stats;
+    unsigned int v;
+    u64 bus_reads;
+    int ret;
+
+    if (reg > REG_ID_OFF)
+        return -EINVAL;
+    stats = &data->reg_stats[reg];
+
+    if (snap) {
+        mutex_lock(&data->snap_lock);
+        stats->reads++;
+        if (picocalc_mfd_snap_fresh(snap, ktime_get())) {
+            *val = snap->val;
+            stats->hits++;
+            mutex_unlock(&data->snap_lock);
+            return 0;
+        }
+        mutex_unlock(&data->snap_lock);
+
+        return picocalc_mfd_snap_refresh(data, client, snap - data->snap, prio, val);
+    }
+
+    /* holding the bus, a change in bus_reads can only be ours */
+    picocalc_mfd_bus_get(data, client, prio);
+    bus_reads = stats->bus_reads;
+    ret = regmap_read(data->regmap, reg, &v);
+    stats->reads++;
+    if (stats->bus_reads == bus_reads)
+        stats->hits++;
+    picocalc_mfd_bus_put(data);
+    if (ret < 0)
+        return ret;
+
+    *val = v;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(picocalc_mfd_read);
+
+int picocalc_mfd_write(struct device *child, u8 reg, u8 val,
+                       enum picocalc_mfd_prio prio)
+{
+    struct picocalc_mfd_data *data = dev_get_drvdata(child->parent);
+    struct picocalc_mfd_snap *snap = picocalc_mfd_snap_find(data, reg);
+    int ret;
+
+    picocalc_mfd_bus_get(data, picocalc_mfd_client_find(data, child), prio);
+    ret = regmap_write(data->regmap, reg, val);
+    picocalc_mfd_bus_put(data);
+
+    /* the MCU may clamp, let the next read fetch what it really took */
+    if (snap) {
+        mutex_lock(&data->snap_lock);
+        picocalc_mfd_snap_invalidate(snap);
+        mutex_unlock(&data->snap_lock);
+    }
+
+    return ret;
+}
+EXPORT_SYMBOL_GPL(picocalc_mfd_write);
+
+static int picocalc_mfd_snap_init(struct picocalc_mfd_data *data)
+{
+    const struct picocalc_mfd_regs *regs = data->fw.regs;
+    const struct {
+        u8 reg;
+        u16 max_age_ms;
+    } init[PICOCALC_SNAP_NR] = {
+        /* the keyboard's own keys change both backlights */
+        { regs->bkl, 500 },
+        { regs->bk2, 500 },
+        { regs->bat, 2000 },
+    };
+    int i;
+
+    for (i = 0; i < PICOCALC_SNAP_NR; i++) {
+        data->snap[i].reg = init[i].reg;
+        data->snap[i].max_age_ms = init[i].max_age_ms;
+    }
+
+    return 0;
+}
+
+/*
+ * Whether a read past the first value byte returns the registers that
+ * follow, compared against one by one reads of TYP, VER and CFG. Firmware
+ * without block reads pads with a constant or repeats a byte, that can
+ * only pass when VER or TYP equals CFG, so those values are not trusted.
+ */
+static bool picocalc_mfd_detect_block_read(struct picocalc_mfd_data *data)
+{
+    const struct picocalc_mfd_fw *fw = &data->fw;
+    unsigned int cfg;
+    u8 buf[4];
+
+    if (regmap_read(data->regmap, fw->regs->cfg, &cfg) < 0)
+        return false;
+    if (fw->version == cfg || fw->type == cfg)
+        return false;
+    if (picocalc_mfd_raw_read(data, fw->regs->typ, buf, sizeof(buf)) < 0)
+        return false;
+
+    return buf[0] == fw->regs->typ && buf[1] == fw->type &&
+           buf[2] == fw->version && buf[3] == cfg;
+}
+
+static int picocalc_mfd_negotiate(struct picocalc_mfd_data *data)
+{
+    struct picocalc_mfd_fw *fw = &data->fw;
+    struct device *dev = data->dev;
+    struct regmap *regmap = data->regmap;
+    unsigned int val;
+    int ret;
+
+    /* the only layout known, TYP, VER and CFG sit where every firmware has them */
+    fw->regs = &picocalc_mfd_regs_v1;
+
+    ret = regmap_read(regmap, REG_ID_TYP, &val);
+    if (ret < 0) {
+        dev_err(dev, "Failed to read firmware type\n");
+        return ret;
+    }
+    fw->type = val;
+
+    ret = regmap_read(regmap, REG_ID_VER, &val);
+    if (ret < 0) {
+        dev_err(dev, "Failed to read firmware version\n");
+        return ret;
+    }
+    fw->version = val;
+
+    /*
+     * No firmware source backs a type or version table, so only what can
+     * be tried on the MCU without side effects is turned on here.
+     * Interrupts, bulk FIFO reads and the matrix scan wait for fw_features.
+     */
+    fw->features = 0;
+    if (picocalc_mfd_detect_block_read(data))
+        fw->features |= PICOCALC_FEAT_BLOCK_READ;
+
+    if (fw_features >= 0)
+        fw->features = fw_features;
+
+    return 0;
+}
+
+static int picocalc_mfd_cache_show(struct seq_file *m, void *v)
+{
+    struct picocalc_mfd_data *data = m->private;
+    struct picocalc_mfd_reg_stats *stats;
+    const char *policy;
+    unsigned int reg;
+
+    seq_puts(m, "reg  policy    reads      hits       misses     bus_reads  bus_writes\n");
+    for (reg = 0; reg <= REG_ID_OFF; reg++) {
+        stats = &data->reg_stats[reg];
+        if (picocalc_mfd_snap_find(data, reg))
+            policy = "snapshot";
+        else if (picocalc_mfd_volatile_reg(data->dev, reg))
+            policy = "volatile";
+        else
+            policy = "cached";
+
+        seq_printf(m, "0x%02x %-9s %-10llu %-10llu %-10llu %-10llu %llu\n",
+                   reg, policy, stats->reads, stats->hits,
+                   stats->reads - stats->hits, stats->bus_reads, stats->bus_writes);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(picocalc_mfd_cache);
+
+static void picocalc_mfd_seq_duty(struct seq_file *m, const char *label,
+                                  u64 busy_ns, u64 elapsed_ns)
+{
+    u64 permyriad = elapsed_ns ? div64_u64(busy_ns * 10000, elapsed_ns) : 0;
+    u32 frac;
+    u64 pct = div_u64_rem(permyriad, 100, &frac);
+
+    seq_printf(m, "%s %llu.%02u%% (%llu of %llu ms)\n", label, pct, frac,
+               div_u64(busy_ns, NSEC_PER_MSEC), div_u64(elapsed_ns, NSEC_PER_MSEC));
+}
+
+static void picocalc_mfd_seq_hist(struct seq_file *m, const char *label, const u64 *hist)
+{
+    int i;
+
+    seq_printf(m, "  %s", label);
+    for (i = 0; i < PICOCALC_LAT_NR; i++)
+        seq_printf(m, " %s%u:%llu", i ? ">=" : "<", i ? 32 << i : 64, hist[i]);
+    seq_putc(m, '\n');
+}
+
+/*
+ * The second duty cycle covers the time since the file was last read.
+ * Counters are copied under client_lock, u64 loads tear on 32 bit.
+ */
+static int picocalc_mfd_bus_show(struct seq_file *m, void *v)
+{
+    struct picocalc_mfd_data *data = m->private;
+    struct picocalc_mfd_client client;
+    ktime_t now = ktime_get();
+    u64 busy_ns = 0, last_busy_ns;
+    ktime_t last_stamp;
+    int i;
+
+    spin_lock(&data->client_lock);
+    for (i = 0; i < PICOCALC_CLIENT_NR; i++)
+        busy_ns += data->clients[i].busy_ns;
+    last_busy_ns = data->duty_busy_ns;
+    last_stamp = data->duty_stamp;
+    data->duty_busy_ns = busy_ns;
+    data->duty_stamp = now;
+    spin_unlock(&data->client_lock);
+
+    picocalc_mfd_seq_duty(m, "duty_cycle:", busy_ns,
+                          ktime_to_ns(ktime_sub(now, data->stats_start)));
+    picocalc_mfd_seq_duty(m, "duty_cycle_since_last_read:", busy_ns - last_busy_ns,
+                          ktime_to_ns(ktime_sub(now, last_stamp)));
+
+    for (i = 0; i < PICOCALC_CLIENT_NR; i++) {
+        spin_lock(&data->client_lock);
+        client = data->clients[i];
+        spin_unlock(&data->client_lock);
+        if (i && !client.dev)
+            break;
+
+        seq_printf(m, "%s: transactions %llu, bytes %llu, errors %llu, retries %llu, busy_ms %llu\n",
+                   client.name, client.transactions, client.bytes, client.errors,
+                   client.retries, div_u64(client.busy_ns, NSEC_PER_MSEC));
+        picocalc_mfd_seq_hist(m, "xfer_us", client.xfer_hist);
+        picocalc_mfd_seq_hist(m, "wait_us", client.wait_hist);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(picocalc_mfd_bus);
+
+static void picocalc_mfd_debugfs_remove(void *arg)
+{
+    struct picocalc_mfd_data *data = arg;
+
+    debugfs_remove_recursive(data->debugfs);
+}
+
+static int picocalc_mfd_debugfs_init(struct picocalc_mfd_data *data)
+{
+    data->debugfs = debugfs_create_dir("picocalc_mfd", NULL);
+    debugfs_create_file("cache", 0444, data->debugfs, data, &picocalc_mfd_cache_fops);
+    debugfs_create_file("bus", 0444, data->debugfs, data, &picocalc_mfd_bus_fops);
+
+    return devm_add_action_or_reset(data->dev, picocalc_mfd_debugfs_remove, data);
+}
+
+static void picocalc_mfd_irq_mask(struct irq_data *d)
+{
+    struct picocalc_mfd_data *data = irq_data_get_irq_chip_data(d);
+
+    clear_bit(irqd_to_hwirq(d), &data->irq_enabled);
+}
+
+static void picocalc_mfd_irq_unmask(struct irq_data *d)
+{
+    struct picocalc_mfd_data *data = irq_data_get_irq_chip_data(d);
+
+    set_bit(irqd_to_hwirq(d), &data->irq_enabled);
+}
+
+static struct irq_chip picocalc_mfd_irq_chip = {
+    .name = "picocalc-mfd",
+    .irq_mask = picocalc_mfd_irq_mask,
+    .irq_unmask = picocalc_mfd_irq_unmask,
+};
+
+static int picocalc_mfd_irq_map(struct irq_domain *d, unsigned int virq,
+                                irq_hw_number_t hw)
+{
+    irq_set_chip_data(virq, d->host_data);
+    irq_set_chip_and_handler(virq, &picocalc_mfd_irq_chip, handle_simple_irq);
+    /* children run in our thread, they are free to talk to the MCU */
+    irq_set_nested_thread(virq, 1);
+    irq_set_noprobe(virq);
+
+    return 0;
+}
+
+static void picocalc_mfd_irq_unmap(struct irq_domain *d, unsigned int virq)
+{
+    irq_set_nested_thread(virq, 0);
+    irq_set_chip_and_handler(virq, NULL, NULL);
+    irq_set_chip_data(virq, NULL);
+}
+
+static const struct irq_domain_ops picocalc_mfd_irq_domain_ops = {
+    .map = picocalc_mfd_irq_map,
+    .unmap = picocalc_mfd_irq_unmap,
+    .xlate = irq_domain_xlate_onecell,
+};
+
+static irqreturn_t picocalc_mfd_irq_hard(int irq, void *dev_id)
+{
+    struct picocalc_mfd_data *data = dev_id;
+
+    atomic64_set(&data->irq_stamp, ktime_get());
+    return IRQ_WAKE_THREAD;
+}
+
+ktime_t picocalc_mfd_irq_timestamp(struct device *child)
+{
+    struct picocalc_mfd_data *data = dev_get_drvdata(child->parent);
+
+    return atomic64_read(&data->irq_stamp);
+}
+EXPORT_SYMBOL_GPL(picocalc_mfd_irq_timestamp);
+
+static irqreturn_t picocalc_mfd_irq_thread(int irq, void *dev_id)
+{
+    struct picocalc_mfd_data *data = dev_id;
+    unsigned int status;
+    unsigned long pending;
+    int ret, bit;
+
+    picocalc_mfd_bus_get(data, &data->clients[0], PICOCALC_PRIO_KBD);
+    ret = regmap_read(data->regmap, data->fw.regs->irq, &status);
+    if (ret < 0) {
+        picocalc_mfd_bus_put(data);
+        dev_err_ratelimited(data->dev, "Failed to read interrupt status, ret=%d\n", ret);
+        return IRQ_NONE;
+    }
+
+    /* ack first, so a source raised while the children run asserts the line again */
+    if (status)
+        regmap_write(data->regmap, data->fw.regs->irq, 0);
+    picocalc_mfd_bus_put(data);
+
+    if (!status)
+        return IRQ_NONE;
+
+    /* INT_BAT means the battery snapshot is out of date */
+    if (status & INT_BAT) {
+        mutex_lock(&data->snap_lock);
+        picocalc_mfd_snap_invalidate(picocalc_mfd_snap_find(data, data->fw.regs->bat));
+        mutex_unlock(&data->snap_lock);
+    }
+
+    pending = status & READ_ONCE(data->irq_enabled);
+    for_each_set_bit(bit, &pending, INT_NR)
+        handle_nested_irq(irq_find_mapping(data->irq_domain, bit));
+
+    return IRQ_HANDLED;
+}
+
+static void picocalc_mfd_irq_domain_remove(void *arg)
+{
+    struct picocalc_mfd_data *data = arg;
+    int hw;
+
+    for (hw = 0; hw < INT_NR; hw++)
+        irq_dispose_mapping(irq_find_mapping(data->irq_domain, hw));
+    irq_domain_remove(data->irq_domain);
+}
+
+/* without an interrupt line the children poll */
+static int picocalc_mfd_irq_init(struct i2c_client *i2c, struct picocalc_mfd_data *data)
+{
+    int ret;
+
+    if (i2c->irq <= 0) {
+        dev_info(&i2c->dev, "No interrupt line, children will poll\n");
+        return 0;
+    }
+
+    if (!picocalc_mfd_has(&data->fw, PICOCALC_FEAT_INT)) {
+        dev_warn(&i2c->dev, "Firmware does not report interrupts, children will poll\n");
+        return 0;
+    }
+
+    data->irq_domain = irq_domain_add_linear(i2c->dev.of_node, INT_NR,
+                                             &picocalc_mfd_irq_domain_ops, data);
+    if (!data->irq_domain) {
+        dev_err(&i2c->dev, "Failed to create irq domain\n");
+        return -ENOMEM;
+    }
+
+    ret = devm_add_action_or_reset(&i2c->dev, picocalc_mfd_irq_domain_remove, data);
+    if (ret)
+        return ret;
+
+    /* drop whatever was latched before we were around to handle it */
+    regmap_write(data->regmap, data->fw.regs->irq, 0);
+
+    ret = devm_request_threaded_irq(&i2c->dev, i2c->irq, picocalc_mfd_irq_hard,
+                                    picocalc_mfd_irq_thread, IRQF_ONESHOT,
+                                    dev_name(&i2c->dev), data);
+    if (ret) {
+        dev_err(&i2c->dev, "Could not claim IRQ %d; error %d\n", i2c->irq, ret);
+        return ret;
+    }
+
+    return 0;
+}
+
 static int picocalc_mfd_probe(struct i2c_client *i2c, const struct i2c_device_id *id)
 {
     struct regmap *regmap;
-    unsigned int fw_type, fw_version;
     int ret;
     struct picocalc_mfd_data *data;
 
@@ -81,36 +991,50 @@ static int picocalc_mfd_probe(struct i2c_client *i2c, const struct i2c_device_id
     }
 
     i2c_set_clientdata(i2c, data);
-
-    ret = device_property_read_u32(&i2c->dev, "poweroff", &data->poweroff_reg);
-    if (ret) {
-        dev_err(&i2c->dev, "Failed to read 'poweroff' property\n");
-        return ret;
-    }
+    data->dev = &i2c->dev;
+    data->i2c = i2c;
+    spin_lock_init(&data->client_lock);
+    strscpy(data->clients[0].name, "core", sizeof(data->clients[0].name));
+    data->cur_client = &data->clients[0];
+    data->stats_start = ktime_get();
+    data->duty_stamp = data->stats_start;
 
     /* Initialize the regmap for the I2C device */
-    regmap = devm_regmap_init_i2c(i2c, &picocalc_mfd_regmap_config);
+    regmap = devm_regmap_init(&i2c->dev, NULL, data, &picocalc_mfd_regmap_config);
     if (IS_ERR(regmap)) {
         dev_err(&i2c->dev, "Failed to initialize regmap\n");
         return PTR_ERR(regmap);
     }
 
-    /* Read firmware type and version */
-    ret = regmap_read(regmap, REG_ID_TYP, &fw_type);
-    if (ret < 0) {
-        dev_err(&i2c->dev, "Failed to read firmware type\n");
-        return ret;
-    }
+    data->regmap = regmap;
+    spin_lock_init(&data->bus_lock);
+    INIT_LIST_HEAD(&data->bus_waiters);
+    mutex_init(&data->snap_lock);
 
-    ret = regmap_read(regmap, REG_ID_VER, &fw_version);
-    if (ret < 0) {
-        dev_err(&i2c->dev, "Failed to read firmware version\n");
+    /* Read firmware type and version, and work out what it can do */
+    ret = picocalc_mfd_negotiate(data);
+    if (ret < 0)
         return ret;
-    }
+
+    /* the registry knows the power off register, DT may still override it */
+    data->poweroff_reg = data->fw.regs->off;
+    device_property_read_u32(&i2c->dev, "poweroff", &data->poweroff_reg);
 
     dev_info(&i2c->dev,
-             "PicoCalc MFD initialized at I2C address 0x%02x, firmware type 0x%02x, version 0x%02x\n",
-             i2c->addr, fw_type, fw_version);
+             "PicoCalc MFD initialized at I2C address 0x%02x, firmware type 0x%02x, version 0x%02x, features 0x%02lx\n",
+             i2c->addr, data->fw.type, data->fw.version, data->fw.features);
+
+    ret = picocalc_mfd_snap_init(data);
+    if (ret)
+        return ret;
+
+    ret = picocalc_mfd_irq_init(i2c, data);
+    if (ret)
+        return ret;
+
+    ret = picocalc_mfd_debugfs_init(data);
+    if (ret)
+        return ret;
 
     ret = sysfs_create_group(&i2c->dev.kobj, &picocalc_mfd_attr_group);
     if (ret) {
@@ -140,7 +1064,10 @@ static void picocalc_mfd_shutdown(struct i2c_client *i2c)
     }
 
     dev_info(&i2c->dev, "Power Off\n");
-    regmap_write(regmap, data->poweroff_reg | (1<<7), 1);
+    /* the keyboard poller may still be running, wait for the bus like it does */
+    picocalc_mfd_bus_get(data, &data->clients[0], PICOCALC_PRIO_DEFAULT);
+    regmap_write(regmap, data->poweroff_reg, 1);
+    picocalc_mfd_bus_put(data);
 }
 
 static const struct of_device_id picocalc_mfd_of_match[] = {
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Interface between the PicoCalc MFD core and its child drivers
+ */
+
+#ifndef PICOCALC_MFD_H
+#define PICOCALC_MFD_H
+
+#include <linux/bits.h>
+#include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+
+#include "picocalc_reg.h"
+
+/* features of the keyboard MCU firmware, detected at probe or set by fw_features */
+#define PICOCALC_FEAT_INT           BIT(0)  /* REG_ID_INT/REG_ID_CFG interrupt reporting */
+#define PICOCALC_FEAT_BULK_FIFO     BIT(1)  /* REG_ID_FIF read returns n entries for 2n bytes */
+#define PICOCALC_FEAT_MATRIX        BIT(3)  /* REG_ID_C64_MTX/REG_ID_C64_JS scan state */
+#define PICOCALC_FEAT_BLOCK_READ    BIT(4)  /* n + 1 byte read returns echo and n registers */
+
+/* order in which waiting children get the bus, lowest first */
+enum picocalc_mfd_prio {
+    PICOCALC_PRIO_KBD,
+    PICOCALC_PRIO_DEFAULT,
+};
+
+/* where a firmware keeps each register, children never hard code addresses */
+struct picocalc_mfd_regs {
+    u8 typ;
+    u8 ver;
+    u8 cfg;
+    u8 irq;
+    u8 key;
+    u8 bkl;
+    u8 deb;
+    u8 frq;
+    u8 rst;
+    u8 fif;
+    u8 bk2;
+    u8 bat;
+    u8 c64_mtx;
+    u8 c64_js;
+    u8 off;
+};
+
+struct picocalc_mfd_fw {
+    u8 type;
+    u8 version;
+    unsigned long features;
+    const struct picocalc_mfd_regs *regs;
+};
+
+/* firmware description for a child device of the MFD */
+const struct picocalc_mfd_fw *picocalc_mfd_get_fw(struct device *child);
+
+/*
+ * Register access for children. Reads of snapshot registers are served
+ * from the last value read while it is fresh enough and registers
+ * only the host changes from the regmap cache, everything else queues for
+ * the bus by priority. picocalc_mfd_bulk_read() returns the raw bytes the
+ * MCU sends after reg, echo included, and is never cached.
+ */
+int picocalc_mfd_read(struct device *child, u8 reg, u8 *val,
+                      enum picocalc_mfd_prio prio);
+int picocalc_mfd_bulk_read(struct device *child, u8 reg, void *buf,
+                           size_t len, enum picocalc_mfd_prio prio);
+int picocalc_mfd_write(struct device *child, u8 reg, u8 val,
+                       enum picocalc_mfd_prio prio);
+
+/*
+ * CLOCK_MONOTONIC time the MCU's interrupt line last fired, for children
+ * handling a nested IRQ that want to know when their event really happened.
+ */
+ktime_t picocalc_mfd_irq_timestamp(struct device *child);
+
+static inline bool picocalc_mfd_has(const struct picocalc_mfd_fw *fw,
+                                    unsigned long feature)
+{
+    return (fw->features & feature) == feature;
+}
+
+#endif
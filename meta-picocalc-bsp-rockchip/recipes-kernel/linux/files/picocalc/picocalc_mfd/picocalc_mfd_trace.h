@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Tracepoints for the PicoCalc MFD I2C traffic
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM picocalc_mfd
+
+#if !defined(PICOCALC_MFD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define PICOCALC_MFD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* one per i2c_transfer() to the MCU, retries included in duration */
+TRACE_EVENT(picocalc_mfd_xfer,
+    TP_PROTO(const char *client, u8 reg, bool write, u16 len,
+             int ret, unsigned int retries, u64 duration_ns),
+
+    TP_ARGS(client, reg, write, len, ret, retries, duration_ns),
+
+    TP_STRUCT__entry(
+        __string(client, client)
+        __field(u8, reg)
+        __field(bool, write)
+        __field(u16, len)
+        __field(int, ret)
+        __field(unsigned int, retries)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __assign_str(client, client);
+        __entry->reg = reg;
+        __entry->write = write;
+        __entry->len = len;
+        __entry->ret = ret;
+        __entry->retries = retries;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("%s %s reg=0x%02x len=%u ret=%d retries=%u duration_ns=%llu",
+              __get_str(client), __entry->write ? "write" : "read",
+              __entry->reg, __entry->len, __entry->ret, __entry->retries,
+              __entry->duration_ns)
+);
+
+/* time a child spent queued behind others for the bus */
+TRACE_EVENT(picocalc_mfd_bus_wait,
+    TP_PROTO(const char *client, int prio, u64 wait_ns),
+
+    TP_ARGS(client, prio, wait_ns),
+
+    TP_STRUCT__entry(
+        __string(client, client)
+        __field(int, prio)
+        __field(u64, wait_ns)
+    ),
+
+    TP_fast_assign(
+        __assign_str(client, client);
+        __entry->prio = prio;
+        __entry->wait_ns = wait_ns;
+    ),
+
+    TP_printk("%s prio=%d wait_ns=%llu",
+              __get_str(client), __entry->prio, __entry->wait_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE picocalc_mfd_trace
+#include <trace/define_trace.h>
@@ -17,6 +17,20 @@
 #define REG_ID_C64_JS 0x0d // joystick io bits
 #define REG_ID_OFF 0x0e // power off
 
+/* REG_ID_KEY low bits hold the number of FIFO entries */
+#define KEY_COUNT_MASK  0x1F
+
+/* REG_ID_INT sources, written back as 0 to acknowledge */
+#define INT_OVERFLOW    (1 << 0) // key fifo overflowed
+#define INT_CAPSLOCK    (1 << 1)
+#define INT_NUMLOCK     (1 << 2)
+#define INT_KEY         (1 << 3) // key fifo not empty
+#define INT_PANIC       (1 << 4)
+#define INT_GPIO        (1 << 5)
+#define INT_BAT         (1 << 6) // battery state changed, custom firmware
+#define INT_PWR         (1 << 7) // power button, custom firmware
+#define INT_NR          8
+
 /* Most significant bit is used for masking in this driver */
 /* MSB must be set on register address when writing        */
 /* MSB is used as a boolean flag with 7 bit return data.   */
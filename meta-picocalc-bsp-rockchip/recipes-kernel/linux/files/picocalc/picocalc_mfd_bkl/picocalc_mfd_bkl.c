@@ -7,12 +7,13 @@
 #include <linux/device.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
-#include <linux/regmap.h>
 #include <linux/of.h>
+
+#include "../picocalc_mfd/picocalc_mfd.h"
 #include <linux/ioport.h>
 
 struct picocalc_mfd_bkl {
-    struct regmap *regmap;
+    struct device *dev;
     struct backlight_device *bldev;
     unsigned int reg;
 };
@@ -31,10 +32,10 @@ static int picocalc_bkl_update_status(struct backlight_device *bldev)
          * Blanking: poll hardware first to capture any button changes before turning off.
          * This preserves the brightness value so it can be restored on unblank.
          */
-        u8 buf[2];
-        int ret = regmap_bulk_read(bkl->regmap, bkl->reg, buf, 2);
+        u8 val;
+        int ret = picocalc_mfd_read(bkl->dev, bkl->reg, &val, PICOCALC_PRIO_DEFAULT);
         if (ret == 0) {
-            bldev->props.brightness = buf[1];
+            bldev->props.brightness = val;
         } else {
             dev_err(&bldev->dev, "Failed to read hw brightness before blanking, ret=%d\n", ret);
         }
@@ -47,26 +48,26 @@ static int picocalc_bkl_update_status(struct backlight_device *bldev)
         brightness = bldev->props.brightness;
     }
 
-    return regmap_write(bkl->regmap, bkl->reg | (1<<7), brightness);
+    return picocalc_mfd_write(bkl->dev, bkl->reg, brightness, PICOCALC_PRIO_DEFAULT);
 }
 
 static int picocalc_bkl_get_brightness(struct backlight_device *bldev)
 {
     struct picocalc_mfd_bkl *bkl = bl_get_data(bldev);
-    u8 buf[2];
+    u8 val;
     int ret;
 
-    ret = regmap_bulk_read(bkl->regmap, bkl->reg, buf, 2);
+    ret = picocalc_mfd_read(bkl->dev, bkl->reg, &val, PICOCALC_PRIO_DEFAULT);
     if (ret < 0) {
         dev_err(&bldev->dev, "Failed to read brightness, ret=%d\n", ret);
         return ret;
     }
 
     /* Always keep track of actual hardware brightness */
-    bldev->props.brightness = buf[1];
+    bldev->props.brightness = val;
     
     /* Return 0 if powered down, actual brightness otherwise */
-    return (bldev->props.power == FB_BLANK_POWERDOWN) ? 0 : buf[1];
+    return (bldev->props.power == FB_BLANK_POWERDOWN) ? 0 : val;
 }
 
 static const struct backlight_ops picocalc_bkl_ops = {
@@ -85,18 +86,10 @@ static int picocalc_mfd_bkl_probe(struct platform_device *pdev)
     if (!bkl)
         return -ENOMEM;
 
-    u32 reg_addr;
-    if (of_property_read_u32(pdev->dev.of_node, "reg", &reg_addr)) {
-        dev_err(&pdev->dev, "Failed to get reg property\n");
-        return -EINVAL;
-    }
-    bkl->reg = reg_addr;
+    /* DT reg is only the unit address, the firmware's layout has the register */
+    bkl->reg = picocalc_mfd_get_fw(dev)->regs->bkl;
 
-    bkl->regmap = dev_get_regmap(dev->parent, NULL);
-    if (!bkl->regmap) {
-        dev_err(dev, "Failed to get parent regmap\n");
-        return -EINVAL;
-    }
+    bkl->dev = dev;
 
     memset(&props, 0, sizeof(struct backlight_properties));
     props.type = BACKLIGHT_RAW;
@@ -5,13 +5,15 @@
 
 #include <linux/power_supply.h>
 #include <linux/device.h>
+#include <linux/interrupt.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
-#include <linux/regmap.h>
 #include <linux/of.h>
 
+#include "../picocalc_mfd/picocalc_mfd.h"
+
 struct picocalc_mfd_bms {
-	struct regmap *regmap;
+	struct device *dev;
 	struct power_supply *psy;
 	struct module *parent_module;
 	unsigned int reg;
@@ -22,12 +24,12 @@ static int picocalc_bms_get_property(struct power_supply *psy,
                                      union power_supply_propval *val)
 {
     struct picocalc_mfd_bms *bat = power_supply_get_drvdata(psy);
-    u8 buf[2];
+    u8 raw = 0;
     int ret;
 
-    /* Read the battery status register when needed */
+    /* Read the battery status register when needed, served from the MFD snapshot */
     if (psp == POWER_SUPPLY_PROP_STATUS || psp == POWER_SUPPLY_PROP_CAPACITY) {
-        ret = regmap_bulk_read(bat->regmap, bat->reg, buf, 2);
+        ret = picocalc_mfd_read(bat->dev, bat->reg, &raw, PICOCALC_PRIO_DEFAULT);
         if (ret < 0)
             return ret;
     }
@@ -35,16 +37,16 @@ static int picocalc_bms_get_property(struct power_supply *psy,
     switch (psp) {
     case POWER_SUPPLY_PROP_STATUS:
         /* high bit indicates charging */
-        if (buf[1] & (1 << 7))
+        if (raw & (1 << 7))
             val->intval = POWER_SUPPLY_STATUS_CHARGING;
-        else if ((buf[1] & ~(1 << 7)) == 100)
+        else if ((raw & ~(1 << 7)) == 100)
             val->intval = POWER_SUPPLY_STATUS_FULL;
         else
             val->intval = POWER_SUPPLY_STATUS_DISCHARGING;
         break;
     case POWER_SUPPLY_PROP_CAPACITY:
         /* clear charging status bit */
-        val->intval = buf[1] & ~(1 << 7);
+        val->intval = raw & ~(1 << 7);
         break;
     case POWER_SUPPLY_PROP_TECHNOLOGY:
         val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
@@ -74,28 +76,30 @@ static const struct power_supply_desc picocalc_bms_desc = {
     .get_property = picocalc_bms_get_property,
 };
 
+/* INT_BAT from the MFD, without it userspace polls as before */
+static irqreturn_t picocalc_bms_irq_handler(int irq, void *dev_id)
+{
+    struct picocalc_mfd_bms *bat = dev_id;
+
+    power_supply_changed(bat->psy);
+    return IRQ_HANDLED;
+}
+
 static int picocalc_mfd_bms_probe(struct platform_device *pdev)
 {
 	struct device *dev = &pdev->dev;
 	struct picocalc_mfd_bms *bat;
 	struct power_supply_config psy_cfg = {};
+	int irq, ret;
 
 	bat = devm_kzalloc(dev, sizeof(*bat), GFP_KERNEL);
 	if (!bat)
 		return -ENOMEM;
 
-    u32 reg_addr;
-    if (of_property_read_u32(pdev->dev.of_node, "reg", &reg_addr)) {
-        dev_err(&pdev->dev, "Failed to get reg property\n");
-        return -EINVAL;
-    }
-    bat->reg = reg_addr;
+    /* DT reg is only the unit address, the firmware's layout has the register */
+    bat->reg = picocalc_mfd_get_fw(dev)->regs->bat;
 
-	bat->regmap = dev_get_regmap(dev->parent, NULL);
-	if (!bat->regmap) {
-		dev_err(dev, "Failed to get parent regmap\n");
-		return -EINVAL;
-	}
+	bat->dev = dev;
 
 	psy_cfg.drv_data = bat;
 	bat->psy = devm_power_supply_register(dev, &picocalc_bms_desc, &psy_cfg);
@@ -104,6 +108,18 @@ static int picocalc_mfd_bms_probe(struct platform_device *pdev)
 		return PTR_ERR(bat->psy);
 	}
 
+    irq = platform_get_irq_optional(pdev, 0);
+    if (irq == -EPROBE_DEFER)
+        return irq;
+    if (irq > 0) {
+        ret = devm_request_threaded_irq(dev, irq, NULL, picocalc_bms_irq_handler,
+                                        IRQF_ONESHOT, dev_name(dev), bat);
+        if (ret) {
+            dev_err(dev, "Could not claim IRQ %d; error %d\n", irq, ret);
+            return ret;
+        }
+    }
+
 	platform_set_drvdata(pdev, bat);
 
 	dev_info(dev, "Battery monitoring system registered successfully\n");
@@ -1,42 +1,118 @@
 // SPDX-License-Identifier: GPL-2.0-only
 /*
  * Keyboard Driver for picocalc
+ *
+ * Each poll is timestamped when it was triggered (timer expiry or the
+ * MFD's interrupt line), when it started, when the FIFO read finished and
+ * when the events were delivered. The trigger time is what the events
+ * carry, the per stage histograms are in debugfs picocalc_mfd_kbd/latency.
+ * Polls run on the driver's own high priority workqueue, so a busy
+ * system_wq (display flushes, writeback) does not show up in "wake".
+ *
+ * With matrix_mode set and a firmware that has REG_ID_C64_MTX, every poll
+ * reads the whole key matrix and REG_ID_C64_JS behind it in one transfer,
+ * every poll_matrix_us, and reports the difference to the previous scan.
+ * Any number of keys can be down at once and nothing is lost to FIFO
+ * overflow. The firmware still queues key events, the FIFO is drained and
+ * dropped after each scan that saw a change. The matrix shape and keymap
+ * come from the standard matrix-keymap DT properties, the joystick is
+ * reported on a second, gamepad device.
  */
 
 #include <linux/version.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/input.h>
+#include <linux/input/matrix_keypad.h>
 #include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
 #include <linux/i2c.h>
 #include <linux/platform_device.h>
 #include <linux/regmap.h>
 #include <linux/of.h>
+#include <linux/property.h>
 
 
 #include "picocalc_kbd_code.h"
+#include "../picocalc_mfd/picocalc_mfd.h"
 
 //#include "config.h"
 #include "debug_levels.h"
 
-#define REG_ID_BAT (0x0b)
-#define REG_ID_BKL (0x05)
-#define REG_ID_FIF (0x09)
-#define REG_ID_BK2 (0x0A)
-
-#define PICOCALC_WRITE_MASK (1<<7)
-
 #define KBD_BUS_TYPE        BUS_I2C
 #define KBD_VENDOR_ID       0x0001
 #define KBD_PRODUCT_ID      0x0001
 #define KBD_VERSION_ID      0x0001
+#define KBD_JS_PRODUCT_ID   0x0002
 
 #define KBD_FIFO_SIZE               31
 
+// REG_ID_C64_MTX answers its echo, then one byte per row with a bit per column
+#define KBD_MATRIX_ROWS_MAX         16
+#define KBD_MATRIX_COLS_MAX         8
+#define KBD_JS_BITS                 8
+
+// Latency buckets in microseconds, 0 is below 16, i covers [8 << i, 16 << i)
+#define KBD_LAT_NR                  12
+
+enum kbd_stage
+{
+    KBD_STAGE_WAKE,     // trigger to poll start, timer or IRQ thread scheduling
+    KBD_STAGE_FIFO,     // poll start to FIFO read done, mostly I2C
+    KBD_STAGE_DELIVER,  // FIFO read done to input_sync returning
+    KBD_STAGE_TOTAL,    // trigger to input_sync returning
+    KBD_STAGE_NR,
+};
+
+static const char * const kbd_stage_names[KBD_STAGE_NR] = {
+    [KBD_STAGE_WAKE]    = "wake",
+    [KBD_STAGE_FIFO]    = "fifo_read",
+    [KBD_STAGE_DELIVER] = "deliver",
+    [KBD_STAGE_TOTAL]   = "total",
+};
+
+struct kbd_latency
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[KBD_LAT_NR];
+};
+
 
 
 static uint64_t mouse_fast_move_thr_time = 150000000ull;
-static int8_t mouse_move_step = 1;
+
+// Poll interval while keys or the mouse are active, close to the old HZ / 128
+static uint poll_fast_us = 5000;
+module_param(poll_fast_us, uint, 0644);
+
+// Interval the poller decays to once nothing happened for poll_hold_ms
+static uint poll_idle_us = 80000;
+module_param(poll_idle_us, uint, 0644);
+
+static uint poll_hold_ms = 1000;
+module_param(poll_hold_ms, uint, 0644);
+
+// Fixed scan interval in matrix mode, a tap shorter than this can be missed
+static uint poll_matrix_us = 10000;
+module_param(poll_matrix_us, uint, 0644);
+
+// Drain the FIFO in one read: -1 as picocalc_mfd.fw_features says, 0 never, 1 always
+static int fifo_bulk = -1;
+module_param(fifo_bulk, int, 0444);
+
+// Scan the key matrix instead of reading the FIFO, for games and emulators
+static bool matrix_mode;
+module_param(matrix_mode, bool, 0444);
+
+// REG_ID_C64_JS bits from bit 0 up, "joystick-keymap" in DT overrides it
+static const uint32_t kbd_js_keymap_default[KBD_JS_BITS] = {
+    BTN_DPAD_UP, BTN_DPAD_DOWN, BTN_DPAD_LEFT, BTN_DPAD_RIGHT, BTN_SOUTH,
+};
 
 // From keyboard firmware source
 enum pico_key_state
@@ -61,16 +137,42 @@ struct key_fifo_item
 
 struct kbd_ctx
 {
+    // Polls run here rather than on system_wq, away from display and disk work
+    struct workqueue_struct *wq;
     struct work_struct work_struct;
     uint8_t version_number;
 
+    // INT_KEY from the MFD, 0 when polling
+    int irq;
+    // Serializes FIFO handling between the IRQ thread and the poll work
+    struct mutex lock;
+
+    // Adaptive poller, only runs for mouse motion in IRQ mode
+    struct hrtimer poll_timer;
+    uint32_t poll_interval_us;
+    ktime_t last_activity;
+    // Polls done, and their rate over the last full second
+    uint64_t wakeups;
+    uint64_t wakeups_window;
+    uint32_t wakeups_per_sec;
+    ktime_t window_start;
+    // Timer expiry (ktime) that queued the pending poll work, 0 when none.
+    // Shared with the timer, atomic64 so 32 bit ARM never sees half of it.
+    atomic64_t poll_trigger;
+    // Set under lock by input_shutdown(), nothing polls or re-arms after it
+    bool stopping;
+
+    // Stage latencies of polls that delivered key events
+    struct kbd_latency latency[KBD_STAGE_NR];
+    struct dentry *debugfs;
+
+    struct device *dev;
     struct i2c_client *i2c_client;
     struct regmap *regmap;
+    // Negotiated by the MFD, register addresses come from fw->regs
+    const struct picocalc_mfd_fw *fw;
     struct input_dev *input_dev;
 
-    // Map from input HID scancodes to Linux keycodes
-    uint8_t *keycode_map;
-
     // Key state and touch FIFO queue
     uint8_t key_fifo_count;
     struct key_fifo_item key_fifo_data[KBD_FIFO_SIZE];
@@ -78,6 +180,30 @@ struct kbd_ctx
 
     int mouse_mode;
     uint8_t mouse_move_dir;
+    int8_t mouse_move_step;
+
+    // Count from REG_ID_KEY, then all entries in one transfer
+    bool fifo_bulk;
+    // I2C transactions spent draining the FIFO and the events they brought
+    uint64_t fifo_transactions;
+    uint64_t fifo_events;
+
+    // Matrix scan mode, state is the last scan reported
+    bool matrix;
+    bool matrix_active_low;
+    bool matrix_valid;
+    unsigned int matrix_rows;
+    unsigned int matrix_cols;
+    unsigned int matrix_row_shift;
+    uint8_t matrix_scan[KBD_MATRIX_ROWS_MAX];
+    uint8_t matrix_state[KBD_MATRIX_ROWS_MAX];
+
+    // Gamepad for REG_ID_C64_JS, only in matrix mode
+    struct input_dev *js_dev;
+    uint32_t js_keymap[KBD_JS_BITS];
+    bool js_valid;
+    uint8_t js_scan;
+    uint8_t js_state;
 };
 
 // Parse 0 to 255 from string
@@ -96,10 +222,10 @@ static inline int parse_u8(char const* buf)
 static inline int kbd_read_i2c_u8(struct kbd_ctx* ctx, uint8_t reg_addr,
     uint8_t* dst)
 {
-    unsigned int val;
+    uint8_t val;
     int ret;
 
-    ret = regmap_read(ctx->regmap, reg_addr, &val);
+    ret = picocalc_mfd_read(ctx->dev, reg_addr, &val, PICOCALC_PRIO_KBD);
     if (ret < 0) {
         dev_err(&ctx->i2c_client->dev,
             "%s Could not read from register 0x%02X, error: %d\n",
@@ -117,7 +243,7 @@ static inline int kbd_write_i2c_u8(struct kbd_ctx* ctx, uint8_t reg_addr,
 {
     int ret;
 
-    ret = regmap_write(ctx->regmap, reg_addr | PICOCALC_WRITE_MASK, src);
+    ret = picocalc_mfd_write(ctx->dev, reg_addr, src, PICOCALC_PRIO_KBD);
     if (ret < 0) {
         dev_err(&ctx->i2c_client->dev,
             "%s Could not write to register 0x%02X, Error: %d\n",
@@ -134,7 +260,7 @@ static inline int kbd_read_i2c_2u8(struct kbd_ctx* ctx, uint8_t reg_addr,
 {
     int ret;
 
-    ret = regmap_bulk_read(ctx->regmap, reg_addr, dst, 2);
+    ret = picocalc_mfd_bulk_read(ctx->dev, reg_addr, dst, 2, PICOCALC_PRIO_KBD);
     if (ret < 0) {
         dev_err(&ctx->i2c_client->dev,
             "%s Could not read from register 0x%02X, error: %d\n",
@@ -145,28 +271,71 @@ static inline int kbd_read_i2c_2u8(struct kbd_ctx* ctx, uint8_t reg_addr,
     return 0;
 }
 
-// Shared global state for global interfaces such as sysfs
-struct kbd_ctx *g_ctx;
+static bool kbd_fw_has_bulk_fifo(struct kbd_ctx* ctx)
+{
+    if (fifo_bulk >= 0)
+        return fifo_bulk;
+
+    return picocalc_mfd_has(ctx->fw, PICOCALC_FEAT_BULK_FIFO);
+}
 
-void input_fw_read_fifo(struct kbd_ctx* ctx)
+static void input_fw_read_fifo_bulk(struct kbd_ctx* ctx)
 {
-    uint8_t fifo_idx;
+    uint8_t count, data[KBD_FIFO_SIZE * 2];
+    uint8_t fifo_idx, n;
     int rc;
 
     // Read number of FIFO items
-    /*
-    if (kbd_read_i2c_u8(ctx, REG_KEY, &ctx->key_fifo_count)) {
+    ctx->fifo_transactions++;
+    if (kbd_read_i2c_u8(ctx, ctx->fw->regs->key, &count)) {
         return;
     }
-    */
+
+    n = min_t(uint8_t, count & KEY_COUNT_MASK, KBD_FIFO_SIZE);
+    if (!n)
+        return;
+
+    // Read and transfer all FIFO items at once
+    ctx->fifo_transactions++;
+    if ((rc = picocalc_mfd_bulk_read(ctx->dev, ctx->fw->regs->fif, data, n * 2,
+        PICOCALC_PRIO_KBD))) {
+        dev_err(&ctx->i2c_client->dev,
+            "%s Could not read REG_FIF, Error: %d\n", __func__, rc);
+        return;
+    }
+
+    for (fifo_idx = 0; fifo_idx < n; fifo_idx++) {
+        // The FIFO ran dry after the count was taken
+        if (data[fifo_idx * 2] == 0)
+            break;
+
+        ctx->key_fifo_data[fifo_idx]._ = 0;
+        ctx->key_fifo_data[fifo_idx].state = data[fifo_idx * 2];
+        ctx->key_fifo_data[fifo_idx].scancode = data[fifo_idx * 2 + 1];
+        ctx->key_fifo_count++;
+    }
+}
+
+void input_fw_read_fifo(struct kbd_ctx* ctx)
+{
+    uint8_t fifo_idx;
+    int rc;
+
     ctx->key_fifo_count = 0;
 
+    if (ctx->fifo_bulk) {
+        input_fw_read_fifo_bulk(ctx);
+        ctx->fifo_events += ctx->key_fifo_count;
+        return;
+    }
+
     // Read and transfer all FIFO items
     for (fifo_idx = 0; fifo_idx < KBD_FIFO_SIZE; fifo_idx++) {
 
         uint8_t data[2];
         // Read 2 fifo items
-        if ((rc = kbd_read_i2c_2u8(ctx, 0x09,
+        ctx->fifo_transactions++;
+        if ((rc = kbd_read_i2c_2u8(ctx, ctx->fw->regs->fif,
             (uint8_t*)&data))) {
 
             dev_err(&ctx->i2c_client->dev,
@@ -200,6 +369,92 @@ void input_fw_read_fifo(struct kbd_ctx* ctx)
             ctx->key_fifo_data[fifo_idx].scancode);
         */
     }
+    ctx->fifo_events += ctx->key_fifo_count;
+}
+
+// One transfer: echo, a byte per row, then REG_ID_C64_JS when it is reported
+static void input_matrix_read(struct kbd_ctx* ctx)
+{
+    uint8_t data[KBD_MATRIX_ROWS_MAX + 2];
+    uint8_t row;
+    int rc;
+
+    ctx->fifo_transactions++;
+    rc = picocalc_mfd_bulk_read(ctx->dev, ctx->fw->regs->c64_mtx, data,
+        ctx->matrix_rows + (ctx->js_dev ? 2 : 1), PICOCALC_PRIO_KBD);
+    ctx->matrix_valid = !rc;
+    ctx->js_valid = ctx->js_dev && !rc;
+    if (rc) {
+        dev_err_ratelimited(ctx->dev,
+            "%s Could not read REG_C64_MTX, Error: %d\n", __func__, rc);
+        return;
+    }
+
+    // Inverting sets the bits past the last column too, keep only real columns
+    for (row = 0; row < ctx->matrix_rows; row++)
+        ctx->matrix_scan[row] = (ctx->matrix_active_low ?
+            ~data[row + 1] : data[row + 1]) & GENMASK(ctx->matrix_cols - 1, 0);
+    ctx->js_scan = data[ctx->matrix_rows + 1];
+}
+
+// The firmware keeps queueing key events while scanning, drop them so the FIFO never fills
+static void input_matrix_discard_fifo(struct kbd_ctx* ctx)
+{
+    uint64_t events = ctx->fifo_events;
+
+    input_fw_read_fifo(ctx);
+    ctx->fifo_events = events;
+    ctx->key_fifo_count = 0;
+}
+
+// Reports what changed since the last scan, returns the number of key events
+static unsigned int input_matrix_report(struct kbd_ctx* ctx)
+{
+    const unsigned short *keymap = ctx->input_dev->keycode;
+    unsigned long changed;
+    unsigned int row, col, code, events = 0;
+
+    if (ctx->matrix_valid) {
+        for (row = 0; row < ctx->matrix_rows; row++) {
+            changed = ctx->matrix_scan[row] ^ ctx->matrix_state[row];
+            for_each_set_bit(col, &changed, ctx->matrix_cols) {
+                code = MATRIX_SCAN_CODE(row, col, ctx->matrix_row_shift);
+                input_event(ctx->input_dev, EV_MSC, MSC_SCAN, code);
+                input_report_key(ctx->input_dev, keymap[code],
+                    ctx->matrix_scan[row] & BIT(col));
+                events++;
+            }
+            ctx->matrix_state[row] = ctx->matrix_scan[row];
+        }
+    }
+
+    if (ctx->js_dev && ctx->js_valid) {
+        changed = ctx->js_scan ^ ctx->js_state;
+        for_each_set_bit(col, &changed, KBD_JS_BITS) {
+            if (!ctx->js_keymap[col])
+                continue;
+            input_report_key(ctx->js_dev, ctx->js_keymap[col],
+                ctx->js_scan & BIT(col));
+            events++;
+        }
+        ctx->js_state = ctx->js_scan;
+    }
+
+    ctx->fifo_events += events;
+    return events;
+}
+
+// Keys held down keep the poller fast, so releases are seen promptly
+static bool input_matrix_held(struct kbd_ctx* ctx)
+{
+    unsigned int row;
+
+    for (row = 0; row < ctx->matrix_rows; row++) {
+        if (ctx->matrix_state[row] & GENMASK(ctx->matrix_cols - 1, 0))
+            return true;
+    }
+
+    return ctx->js_dev && ctx->js_state;
 }
 
 static void key_report_event(struct kbd_ctx* ctx,
@@ -328,7 +583,7 @@ static void key_report_event(struct kbd_ctx* ctx,
     }
 
     // Update last keypress time
-    g_ctx->last_keypress_at = ktime_get_boottime_ns();
+    ctx->last_keypress_at = ktime_get_boottime_ns();
 
 /*
     if (keycode == KEY_STOP) {
@@ -378,16 +633,89 @@ static void key_report_event(struct kbd_ctx* ctx,
     // input_modifiers_reset(ctx);
 }
 
-static void input_workqueue_handler(struct work_struct *work_struct_ptr)
+// Called with ctx->lock held after every poll, picks and arms the next one
+static void kbd_poll_schedule(struct kbd_ctx *ctx, bool active)
+{
+    ktime_t now = ktime_get();
+    uint32_t fast = max(poll_fast_us, 1000u);
+    uint32_t idle = max(poll_idle_us, fast);
+    uint64_t slack;
+
+    // Snap back on the first event, halve the rate per quiet poll after the hold.
+    // Scans only see keys down at the time, so they never slow down.
+    if (active)
+        ctx->last_activity = now;
+    if (ctx->matrix) {
+        ctx->poll_interval_us = max(poll_matrix_us, 1000u);
+    } else if (active) {
+        ctx->poll_interval_us = fast;
+    } else if (ktime_ms_delta(now, ctx->last_activity) >= poll_hold_ms) {
+        ctx->poll_interval_us = min(ctx->poll_interval_us * 2, idle);
+    }
+
+    ctx->wakeups++;
+    if (ktime_ms_delta(now, ctx->window_start) >= MSEC_PER_SEC) {
+        ctx->wakeups_per_sec = ctx->wakeups - ctx->wakeups_window;
+        ctx->wakeups_window = ctx->wakeups;
+        ctx->window_start = now;
+    }
+
+    // Interrupts bring the keys, keep polling only while the mouse moves.
+    // A scan has to watch for releases itself, so it always keeps polling.
+    if (ctx->stopping || (ctx->irq && !ctx->mouse_move_dir && !ctx->matrix))
+        return;
+
+    // Let idle polls coalesce with other wakeups
+    slack = (uint64_t)ctx->poll_interval_us * NSEC_PER_USEC / 8;
+    hrtimer_start_range_ns(&ctx->poll_timer, us_to_ktime(ctx->poll_interval_us),
+        slack, HRTIMER_MODE_REL);
+}
+
+static void kbd_latency_record(struct kbd_ctx *ctx, enum kbd_stage stage,
+    ktime_t from, ktime_t to)
+{
+    struct kbd_latency *lat = &ctx->latency[stage];
+    uint64_t ns = max_t(int64_t, ktime_to_ns(ktime_sub(to, from)), 0);
+    uint64_t us = div_u64(ns, NSEC_PER_USEC);
+
+    lat->count++;
+    lat->total_ns += ns;
+    lat->max_ns = max(lat->max_ns, ns);
+    lat->hist[us < 16 ? 0 : min_t(uint32_t, ilog2(us) - 3, KBD_LAT_NR - 1)]++;
+}
+
+// trigger is when the poll was asked for, 0 if unknown
+static void input_process(struct kbd_ctx *ctx, ktime_t trigger)
 {
-    struct kbd_ctx *ctx;
     uint8_t fifo_idx;
+    unsigned int events = 0;
+    ktime_t start, fifo_done, delivered;
+    bool active;
 
-    // Get keyboard context from work struct
-    ctx = container_of(work_struct_ptr, struct kbd_ctx, work_struct);
+    mutex_lock(&ctx->lock);
+    if (ctx->stopping) {
+        mutex_unlock(&ctx->lock);
+        return;
+    }
+    start = ktime_get();
+    if (!trigger)
+        trigger = start;
 
-    input_fw_read_fifo(ctx);
-    // Process FIFO items
+    if (ctx->matrix)
+        input_matrix_read(ctx);
+    else
+        input_fw_read_fifo(ctx);
+    fifo_done = ktime_get();
+
+    // Nothing earlier is known about when the keys went down
+    input_set_timestamp(ctx->input_dev, trigger);
+    if (ctx->js_dev)
+        input_set_timestamp(ctx->js_dev, trigger);
+
+    if (ctx->matrix)
+        events = input_matrix_report(ctx);
+
+    // Process FIFO items, there are none in matrix mode
     for (fifo_idx = 0; fifo_idx < ctx->key_fifo_count; fifo_idx++) {
         key_report_event(ctx, &ctx->key_fifo_data[fifo_idx]);
     }
@@ -397,153 +725,415 @@ static void input_workqueue_handler(struct work_struct *work_struct_ptr)
             uint64_t press_time = ktime_get_boottime_ns() - ctx->last_keypress_at;
             if (press_time <= mouse_fast_move_thr_time)
             {
-                mouse_move_step = 1;
+                ctx->mouse_move_step = 1;
             }
             else if (press_time <= 3 * mouse_fast_move_thr_time)
             {
-                mouse_move_step = 2;
+                ctx->mouse_move_step = 2;
             }
             else
             {
-                mouse_move_step = 4;
+                ctx->mouse_move_step = 4;
             }
 
             if (ctx->mouse_move_dir & MOUSE_MOVE_LEFT)
             {
-                input_report_rel(ctx->input_dev, REL_X, -mouse_move_step);
+                input_report_rel(ctx->input_dev, REL_X, -ctx->mouse_move_step);
             }
             if (ctx->mouse_move_dir & MOUSE_MOVE_RIGHT)
             {
-                input_report_rel(ctx->input_dev, REL_X, mouse_move_step);
+                input_report_rel(ctx->input_dev, REL_X, ctx->mouse_move_step);
             }
             if (ctx->mouse_move_dir & MOUSE_MOVE_DOWN)
             {
-                input_report_rel(ctx->input_dev, REL_Y, mouse_move_step);
+                input_report_rel(ctx->input_dev, REL_Y, ctx->mouse_move_step);
             }
             if (ctx->mouse_move_dir & MOUSE_MOVE_UP)
             {
-                input_report_rel(ctx->input_dev, REL_Y, -mouse_move_step);
+                input_report_rel(ctx->input_dev, REL_Y, -ctx->mouse_move_step);
             }
         }
 
+    events += ctx->key_fifo_count;
+    active = events || ctx->mouse_move_dir ||
+        (ctx->matrix && input_matrix_held(ctx));
+
     // Reset pending FIFO count
     ctx->key_fifo_count = 0;
 
-    // Synchronize input system and clear client interrupt flag
+    // Synchronize input system, the MFD already cleared the interrupt flag
     input_sync(ctx->input_dev);
-    /*
-    if (kbd_write_i2c_u8(ctx, REG_INT, 0)) {
-        return;
+    if (ctx->js_dev)
+        input_sync(ctx->js_dev);
+    delivered = ktime_get();
+
+    // Key changes are what the firmware queued, a quiet scan leaves the bus alone
+    if (ctx->matrix && events)
+        input_matrix_discard_fifo(ctx);
+
+    if (events) {
+        kbd_latency_record(ctx, KBD_STAGE_WAKE, trigger, start);
+        kbd_latency_record(ctx, KBD_STAGE_FIFO, start, fifo_done);
+        kbd_latency_record(ctx, KBD_STAGE_DELIVER, fifo_done, delivered);
+        kbd_latency_record(ctx, KBD_STAGE_TOTAL, trigger, delivered);
     }
-    */
+
+    kbd_poll_schedule(ctx, active);
+    mutex_unlock(&ctx->lock);
+}
+
+static void input_workqueue_handler(struct work_struct *work_struct_ptr)
+{
+    // Get keyboard context from work struct
+    struct kbd_ctx *ctx = container_of(work_struct_ptr, struct kbd_ctx, work_struct);
+    // The timer is not armed again until input_process() is done
+    ktime_t trigger = atomic64_xchg(&ctx->poll_trigger, 0);
+
+    input_process(ctx, trigger);
+}
+
+// Nested in the MFD's IRQ thread, so the FIFO can be read right here
+static irqreturn_t input_irq_handler(int irq, void *dev_id)
+{
+    struct kbd_ctx *ctx = dev_id;
+
+    input_process(ctx, picocalc_mfd_irq_timestamp(ctx->dev));
+    return IRQ_HANDLED;
+}
+
+// The FIFO is read over I2C, hand the poll to the work
+static enum hrtimer_restart kbd_poll_timer_function(struct hrtimer *timer)
+{
+    struct kbd_ctx *ctx = container_of(timer, struct kbd_ctx, poll_timer);
+
+    atomic64_set(&ctx->poll_trigger, ktime_get());
+    queue_work(ctx->wq, &ctx->work_struct);
+    return HRTIMER_NORESTART;
+}
+
+static ssize_t poll_interval_us_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct kbd_ctx *ctx = dev_get_drvdata(dev);
+
+    // Polls only run for mouse motion with an interrupt line
+    if (ctx->irq && !hrtimer_active(&ctx->poll_timer))
+        return sysfs_emit(buf, "0\n");
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(ctx->poll_interval_us));
+}
+static DEVICE_ATTR_RO(poll_interval_us);
+
+static ssize_t wakeups_per_sec_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct kbd_ctx *ctx = dev_get_drvdata(dev);
+    uint32_t rate;
+
+    mutex_lock(&ctx->lock);
+    // A window that ended long ago means the poller went quiet
+    rate = ktime_ms_delta(ktime_get(), ctx->window_start) < 2 * MSEC_PER_SEC ?
+        ctx->wakeups_per_sec : 0;
+    mutex_unlock(&ctx->lock);
+
+    return sysfs_emit(buf, "%u\n", rate);
+}
+static DEVICE_ATTR_RO(wakeups_per_sec);
+
+static ssize_t wakeups_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct kbd_ctx *ctx = dev_get_drvdata(dev);
+    uint64_t wakeups;
+
+    mutex_lock(&ctx->lock);
+    wakeups = ctx->wakeups;
+    mutex_unlock(&ctx->lock);
+
+    return sysfs_emit(buf, "%llu\n", wakeups);
+}
+static DEVICE_ATTR_RO(wakeups);
+
+static ssize_t fifo_bulk_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct kbd_ctx *ctx = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", ctx->fifo_bulk);
+}
+static DEVICE_ATTR_RO(fifo_bulk);
+
+// I2C transactions per key event, with two decimals
+static ssize_t fifo_transactions_per_event_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct kbd_ctx *ctx = dev_get_drvdata(dev);
+    uint64_t transactions, events, centi = 0;
+    uint32_t rem;
+
+    mutex_lock(&ctx->lock);
+    transactions = ctx->fifo_transactions;
+    events = ctx->fifo_events;
+    mutex_unlock(&ctx->lock);
+
+    if (events)
+        centi = div64_u64(transactions * 100, events);
+    centi = div_u64_rem(centi, 100, &rem);
+    return sysfs_emit(buf, "%llu.%02u\n", centi, rem);
+}
+static DEVICE_ATTR_RO(fifo_transactions_per_event);
+
+static struct attribute *picocalc_mfd_kbd_attrs[] = {
+    &dev_attr_poll_interval_us.attr,
+    &dev_attr_wakeups_per_sec.attr,
+    &dev_attr_wakeups.attr,
+    &dev_attr_fifo_bulk.attr,
+    &dev_attr_fifo_transactions_per_event.attr,
+    NULL,
+};
+
+static const struct attribute_group picocalc_mfd_kbd_attr_group = {
+    .attrs = picocalc_mfd_kbd_attrs,
+};
+
+static int kbd_latency_show(struct seq_file *m, void *v)
+{
+    struct kbd_ctx *ctx = m->private;
+    struct kbd_latency lat[KBD_STAGE_NR];
+    int stage, i;
+
+    mutex_lock(&ctx->lock);
+    memcpy(lat, ctx->latency, sizeof(lat));
+    mutex_unlock(&ctx->lock);
+
+    for (stage = 0; stage < KBD_STAGE_NR; stage++) {
+        seq_printf(m, "%s: count %llu, avg_us %llu, max_us %llu\n",
+            kbd_stage_names[stage], lat[stage].count,
+            lat[stage].count ?
+                div64_u64(lat[stage].total_ns, lat[stage].count) / NSEC_PER_USEC : 0,
+            div_u64(lat[stage].max_ns, NSEC_PER_USEC));
+        seq_puts(m, " ");
+        for (i = 0; i < KBD_LAT_NR; i++)
+            seq_printf(m, " %s%u:%llu", i ? ">=" : "<", i ? 8 << i : 16,
+                lat[stage].hist[i]);
+        seq_putc(m, '\n');
+    }
+
+    return 0;
 }
-static void kbd_timer_function(struct timer_list *data);
-DEFINE_TIMER(g_kbd_timer,kbd_timer_function);
+DEFINE_SHOW_ATTRIBUTE(kbd_latency);
 
-static void kbd_timer_function(struct timer_list *data)
+// Replaces the FIFO scancode map with the DT matrix keymap, adds the gamepad
+static int input_matrix_probe(struct kbd_ctx *ctx)
 {
-    data = NULL;
-    schedule_work(&g_ctx->work_struct);
-    mod_timer(&g_kbd_timer, jiffies + HZ / 128);
+    struct device *dev = ctx->dev;
+    struct input_dev *input = ctx->input_dev;
+    unsigned int rows, cols, i;
+    int rc, n;
+
+    if ((rc = matrix_keypad_parse_properties(dev, &rows, &cols))) {
+        return rc;
+    }
+    if (rows > KBD_MATRIX_ROWS_MAX || cols > KBD_MATRIX_COLS_MAX) {
+        dev_err(dev, "%s %ux%u matrix, at most %ux%u supported\n",
+            __func__, rows, cols, KBD_MATRIX_ROWS_MAX, KBD_MATRIX_COLS_MAX);
+        return -EINVAL;
+    }
+    ctx->matrix_rows = rows;
+    ctx->matrix_cols = cols;
+    ctx->matrix_row_shift = get_count_order(cols);
+    ctx->matrix_active_low = device_property_read_bool(dev, "matrix-active-low");
+
+    // No mouse emulation and no FIFO scancodes, only what linux,keymap says
+    bitmap_zero(input->keybit, KEY_CNT);
+    __clear_bit(EV_REL, input->evbit);
+    input->keycode = NULL;
+    if ((rc = matrix_keypad_build_keymap(NULL, NULL, rows, cols, NULL, input))) {
+        dev_err(dev, "%s Could not build the matrix keymap, error: %d\n",
+            __func__, rc);
+        return rc;
+    }
+
+    memcpy(ctx->js_keymap, kbd_js_keymap_default, sizeof(ctx->js_keymap));
+    n = device_property_count_u32(dev, "joystick-keymap");
+    if (n > 0) {
+        memset(ctx->js_keymap, 0, sizeof(ctx->js_keymap));
+        device_property_read_u32_array(dev, "joystick-keymap", ctx->js_keymap,
+            min(n, KBD_JS_BITS));
+    }
+
+    if ((ctx->js_dev = devm_input_allocate_device(dev)) == NULL) {
+        return -ENOMEM;
+    }
+    ctx->js_dev->name = devm_kasprintf(dev, GFP_KERNEL, "%s joystick",
+        ctx->i2c_client->name);
+    if (!ctx->js_dev->name) {
+        return -ENOMEM;
+    }
+    ctx->js_dev->id.bustype = KBD_BUS_TYPE;
+    ctx->js_dev->id.vendor  = KBD_VENDOR_ID;
+    ctx->js_dev->id.product = KBD_JS_PRODUCT_ID;
+    ctx->js_dev->id.version = KBD_VERSION_ID;
+    for (i = 0; i < KBD_JS_BITS; i++) {
+        if (ctx->js_keymap[i])
+            input_set_capability(ctx->js_dev, EV_KEY, ctx->js_keymap[i]);
+    }
+
+    if ((rc = input_register_device(ctx->js_dev))) {
+        dev_err(dev, "Failed to register joystick device, error: %d\n", rc);
+        return rc;
+    }
+
+    dev_info(dev, "%s scanning a %ux%u matrix\n", __func__, rows, cols);
+    return 0;
 }
 
-int input_probe(struct i2c_client* i2c_client, struct regmap* regmap)
+static void kbd_destroy_workqueue(void *wq)
 {
+    destroy_workqueue(wq);
+}
+
+// Everything is owned by the keyboard's platform device, not the MFD's
+static int input_probe(struct device *dev, struct i2c_client* i2c_client,
+    struct regmap* regmap, const struct picocalc_mfd_fw *fw, int irq,
+    struct kbd_ctx **ctxp)
+{
+    struct kbd_ctx *ctx;
     int rc, i;
 
     // Allocate keyboard context (managed by device lifetime)
-    g_ctx = devm_kzalloc(&i2c_client->dev, sizeof(*g_ctx), GFP_KERNEL);
-    if (!g_ctx) {
+    ctx = devm_kzalloc(dev, sizeof(*ctx), GFP_KERNEL);
+    if (!ctx) {
         return -ENOMEM;
     }
 
-    // Allocate and copy keycode array
-    g_ctx->keycode_map = devm_kmemdup(&i2c_client->dev, keycodes, NUM_KEYCODES,
-        GFP_KERNEL);
-    if (!g_ctx->keycode_map) {
+    // One poll at a time, high priority and free to run on any CPU
+    ctx->wq = alloc_workqueue("%s", WQ_HIGHPRI | WQ_UNBOUND, 1, dev_name(dev));
+    if (!ctx->wq) {
         return -ENOMEM;
     }
+    if ((rc = devm_add_action_or_reset(dev, kbd_destroy_workqueue, ctx->wq))) {
+        return rc;
+    }
 
     // Initialize keyboard context
-    g_ctx->i2c_client = i2c_client;
-    g_ctx->regmap = regmap;
-    g_ctx->last_keypress_at = ktime_get_boottime_ns();
+    ctx->i2c_client = i2c_client;
+    ctx->dev = dev;
+    ctx->regmap = regmap;
+    ctx->fw = fw;
+    ctx->last_keypress_at = ktime_get_boottime_ns();
 
     // Allocate input device
-    if ((g_ctx->input_dev = devm_input_allocate_device(&i2c_client->dev)) == NULL) {
+    if ((ctx->input_dev = devm_input_allocate_device(dev)) == NULL) {
         dev_err(&i2c_client->dev,
             "%s Could not devm_input_allocate_device BBQX0KBD.\n", __func__);
         return -ENOMEM;
     }
 
     // Initialize input device
-    g_ctx->input_dev->name = i2c_client->name;
-    g_ctx->input_dev->id.bustype = KBD_BUS_TYPE;
-    g_ctx->input_dev->id.vendor  = KBD_VENDOR_ID;
-    g_ctx->input_dev->id.product = KBD_PRODUCT_ID;
-    g_ctx->input_dev->id.version = KBD_VERSION_ID;
+    ctx->input_dev->name = i2c_client->name;
+    ctx->input_dev->id.bustype = KBD_BUS_TYPE;
+    ctx->input_dev->id.vendor  = KBD_VENDOR_ID;
+    ctx->input_dev->id.product = KBD_PRODUCT_ID;
+    ctx->input_dev->id.version = KBD_VERSION_ID;
 
     // Initialize input device keycodes
-    g_ctx->input_dev->keycode = keycodes; //g_ctx->keycode_map;
-    g_ctx->input_dev->keycodesize = sizeof(keycodes[0]);
-    g_ctx->input_dev->keycodemax = ARRAY_SIZE(keycodes);
+    ctx->input_dev->keycode = keycodes;
+    ctx->input_dev->keycodesize = sizeof(keycodes[0]);
+    ctx->input_dev->keycodemax = ARRAY_SIZE(keycodes);
 
     // Set input device keycode bits
     for (i = 0; i < NUM_KEYCODES; i++) {
-        __set_bit(keycodes[i], g_ctx->input_dev->keybit);
+        __set_bit(keycodes[i], ctx->input_dev->keybit);
     }
-    __clear_bit(KEY_RESERVED, g_ctx->input_dev->keybit);
-    __set_bit(EV_REP, g_ctx->input_dev->evbit);
-    __set_bit(EV_KEY, g_ctx->input_dev->evbit);
+    __clear_bit(KEY_RESERVED, ctx->input_dev->keybit);
+    __set_bit(EV_REP, ctx->input_dev->evbit);
+    __set_bit(EV_KEY, ctx->input_dev->evbit);
 
     // Set input device capabilities
-    input_set_capability(g_ctx->input_dev, EV_MSC, MSC_SCAN);
-    input_set_capability(g_ctx->input_dev, EV_REL, REL_X);
-    input_set_capability(g_ctx->input_dev, EV_REL, REL_Y);
+    input_set_capability(ctx->input_dev, EV_MSC, MSC_SCAN);
+    input_set_capability(ctx->input_dev, EV_REL, REL_X);
+    input_set_capability(ctx->input_dev, EV_REL, REL_Y);
 /*
-    input_set_capability(g_ctx->input_dev, EV_ABS, ABS_X);
-    input_set_capability(g_ctx->input_dev, EV_ABS, ABS_Y);
-    input_set_abs_params(g_ctx->input_dev, ABS_X, 0, 320, 4, 8);
-    input_set_abs_params(g_ctx->input_dev, ABS_Y, 0, 320, 4, 8);
+    input_set_capability(ctx->input_dev, EV_ABS, ABS_X);
+    input_set_capability(ctx->input_dev, EV_ABS, ABS_Y);
+    input_set_abs_params(ctx->input_dev, ABS_X, 0, 320, 4, 8);
+    input_set_abs_params(ctx->input_dev, ABS_Y, 0, 320, 4, 8);
 */
-    input_set_capability(g_ctx->input_dev, EV_KEY, BTN_LEFT);
-    input_set_capability(g_ctx->input_dev, EV_KEY, BTN_RIGHT);
-
-    // Request IRQ handler for I2C client and initialize workqueue
-    /*
-    if ((rc = devm_request_threaded_irq(&i2c_client->dev,
-        i2c_client->irq, NULL, input_irq_handler, IRQF_SHARED | IRQF_ONESHOT,
-        i2c_client->name, g_ctx))) {
-
-        dev_err(&i2c_client->dev,
-            "Could not claim IRQ %d; error %d\n", i2c_client->irq, rc);
-        return rc;
+    input_set_capability(ctx->input_dev, EV_KEY, BTN_LEFT);
+    input_set_capability(ctx->input_dev, EV_KEY, BTN_RIGHT);
+
+    ctx->mouse_mode = FALSE;
+    ctx->mouse_move_dir = 0;
+    ctx->mouse_move_step = 1;
+    mutex_init(&ctx->lock);
+    INIT_WORK(&ctx->work_struct, input_workqueue_handler);
+    hrtimer_init(&ctx->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ctx->poll_timer.function = kbd_poll_timer_function;
+    ctx->poll_interval_us = poll_fast_us;
+    ctx->last_activity = ktime_get();
+    ctx->window_start = ctx->last_activity;
+    ctx->fifo_bulk = kbd_fw_has_bulk_fifo(ctx);
+    dev_info(&i2c_client->dev, "%s FIFO drained %s\n", __func__,
+        ctx->fifo_bulk ? "in one transfer" : "per entry");
+
+    if (matrix_mode && !picocalc_mfd_has(fw, PICOCALC_FEAT_MATRIX)) {
+        dev_warn(dev, "Matrix scan not enabled in picocalc_mfd.fw_features, using the key FIFO\n");
+    } else if (matrix_mode) {
+        if ((rc = input_matrix_probe(ctx))) {
+            return rc;
+        }
+        ctx->matrix = true;
     }
-    */
-    g_ctx->mouse_mode = FALSE;
-    g_ctx->mouse_move_dir = 0;
-    INIT_WORK(&g_ctx->work_struct, input_workqueue_handler);
-    g_kbd_timer.expires = jiffies + HZ / 128;
-    add_timer(&g_kbd_timer);
 
     // Register input device with input subsystem
     dev_info(&i2c_client->dev,
         "%s registering input device", __func__);
-    if ((rc = input_register_device(g_ctx->input_dev))) {
+    if ((rc = input_register_device(ctx->input_dev))) {
         dev_err(&i2c_client->dev,
             "Failed to register input device, error: %d\n", rc);
         return rc;
     }
 
+    // Request the INT_KEY handler from the MFD, or fall back to polling
+    if (irq > 0) {
+        // Not devm, it has to be gone before the timer and work are stopped
+        if ((rc = request_threaded_irq(
+            irq, NULL, input_irq_handler, IRQF_ONESHOT,
+            i2c_client->name, ctx))) {
+
+            dev_err(&i2c_client->dev,
+                "Could not claim IRQ %d; error %d\n", irq, rc);
+            return rc;
+        }
+        ctx->irq = irq;
+    }
+
+    ctx->debugfs = debugfs_create_dir(dev_name(dev), NULL);
+    debugfs_create_file("latency", 0444, ctx->debugfs, ctx, &kbd_latency_fops);
+
+    // First poll, in IRQ mode it picks up keys pressed before the handler was in place
+    queue_work(ctx->wq, &ctx->work_struct);
+
+    *ctxp = ctx;
     return 0;
 }
 
-void input_shutdown(struct i2c_client* i2c_client)
+// Stops every source of polls, devm frees the rest after remove
+static void input_shutdown(struct kbd_ctx *ctx)
 {
-    // Remove context from global state
-    // (It is freed by the device-specific memory mananger)
-    del_timer(&g_kbd_timer);
-    g_ctx = NULL;
+    if (ctx->irq)
+        free_irq(ctx->irq, ctx);
+
+    // From here kbd_poll_schedule() no longer arms the timer
+    mutex_lock(&ctx->lock);
+    ctx->stopping = true;
+    mutex_unlock(&ctx->lock);
+
+    // A timer already armed may still queue the work, which then does nothing
+    hrtimer_cancel(&ctx->poll_timer);
+    cancel_work_sync(&ctx->work_struct);
+    debugfs_remove_recursive(ctx->debugfs);
 }
 
 static int picocalc_mfd_kbd_probe(struct platform_device *pdev)
@@ -551,19 +1141,32 @@ static int picocalc_mfd_kbd_probe(struct platform_device *pdev)
     struct device *dev = &pdev->dev;
     struct i2c_client *i2c = to_i2c_client(dev->parent);
     struct regmap *regmap = dev_get_regmap(dev->parent, NULL);
-    int rc;
+    struct kbd_ctx *ctx;
+    int rc, irq;
 
     if (!regmap) {
         dev_err(dev, "Failed to get parent regmap\n");
         return -EINVAL;
     }
 
+    // No interrupts property selects polling
+    irq = platform_get_irq_optional(pdev, 0);
+    if (irq == -EPROBE_DEFER)
+        return irq;
+
     // Initialize key handler system
-    if ((rc = input_probe(i2c, regmap))) {
+    if ((rc = input_probe(dev, i2c, regmap, picocalc_mfd_get_fw(dev), irq, &ctx))) {
         return rc;
     }
 
-    platform_set_drvdata(pdev, g_ctx);
+    platform_set_drvdata(pdev, ctx);
+
+    rc = sysfs_create_group(&dev->kobj, &picocalc_mfd_kbd_attr_group);
+    if (rc) {
+        dev_err(dev, "Failed to create sysfs group\n");
+        input_shutdown(ctx);
+        return rc;
+    }
 
     dev_info(dev, "Keyboard input driver registered successfully\n");
     return 0;
@@ -575,7 +1178,8 @@ static int picocalc_mfd_kbd_remove(struct platform_device *pdev)
 
     dev_info_fe(&pdev->dev, "%s Removing picocalc-kbd.\n", __func__);
 
-    input_shutdown(ctx->i2c_client);
+    sysfs_remove_group(&pdev->dev.kobj, &picocalc_mfd_kbd_attr_group);
+    input_shutdown(ctx);
 
     return 0;
 }
@@ -6,13 +6,14 @@
 #include <linux/leds.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
-#include <linux/regmap.h>
 #include <linux/of.h>
+
+#include "../picocalc_mfd/picocalc_mfd.h"
 #include <linux/fb.h>
 #include <linux/notifier.h>
 
 struct picocalc_mfd_led {
-    struct regmap *regmap;
+    struct device *dev;
     struct led_classdev led_dev;
     unsigned int reg;
     struct notifier_block fb_notifier;
@@ -23,10 +24,10 @@ static enum led_brightness picocalc_led_get_brightness(struct led_classdev *led_
     struct picocalc_mfd_led *led = container_of(led_cdev,
                                                 struct picocalc_mfd_led,
                                                 led_dev);
-    u8 buf[2];
+    u8 val;
     int ret;
 
-    ret = regmap_bulk_read(led->regmap, led->reg, buf, 2);
+    ret = picocalc_mfd_read(led->dev, led->reg, &val, PICOCALC_PRIO_DEFAULT);
     if (ret < 0)
         return ret;
 
@@ -35,9 +36,9 @@ static enum led_brightness picocalc_led_get_brightness(struct led_classdev *led_
      * This is called by the LED trigger before it saves the brightness,
      * so we capture any hardware button changes here.
      */
-    led_cdev->brightness = buf[1];
+    led_cdev->brightness = val;
         
-    return buf[1];
+    return val;
 }
 
 static int picocalc_led_fb_notifier(struct notifier_block *nb,
@@ -57,10 +58,10 @@ static int picocalc_led_fb_notifier(struct notifier_block *nb,
          * About to blank: poll hardware to update cached brightness BEFORE
          * the LED backlight trigger saves it.
          */
-        u8 buf[2];
-        int ret = regmap_bulk_read(led->regmap, led->reg, buf, 2);
+        u8 val;
+        int ret = picocalc_mfd_read(led->dev, led->reg, &val, PICOCALC_PRIO_DEFAULT);
         if (ret == 0) {
-            led->led_dev.brightness = buf[1];
+            led->led_dev.brightness = val;
         }
     }
     
@@ -74,7 +75,7 @@ static void picocalc_led_brightness_set(struct led_classdev *led_cdev,
                                                 struct picocalc_mfd_led,
                                                 led_dev);
     
-    regmap_write(led->regmap, led->reg | (1<<7), brightness);
+    picocalc_mfd_write(led->dev, led->reg, brightness, PICOCALC_PRIO_DEFAULT);
 }
 
 static int picocalc_mfd_led_probe(struct platform_device *pdev)
@@ -87,18 +88,10 @@ static int picocalc_mfd_led_probe(struct platform_device *pdev)
     if (!led)
         return -ENOMEM;
 
-    u32 reg_addr;
-    if (of_property_read_u32(pdev->dev.of_node, "reg", &reg_addr)) {
-        dev_err(&pdev->dev, "Failed to get reg property\n");
-        return -EINVAL;
-    }
-    led->reg = reg_addr;
+    /* DT reg is only the unit address, the firmware's layout has the register */
+    led->reg = picocalc_mfd_get_fw(dev)->regs->bk2;
 
-    led->regmap = dev_get_regmap(dev->parent, NULL);
-    if (!led->regmap) {
-        dev_err(dev, "Failed to get parent regmap\n");
-        return -EINVAL;
-    }
+    led->dev = dev;
 
     led->led_dev.brightness_set = picocalc_led_brightness_set;
     led->led_dev.brightness_get = picocalc_led_get_brightness;